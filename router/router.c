@@ -1,14 +1,20 @@
+#define _DEFAULT_SOURCE
+
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <ifaddrs.h>
 #include <netinet/ip.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #define BUF_SIZE 1024
@@ -16,6 +22,14 @@
 #define MAX_TABLE_LENGTH 20
 #define INF_DIST 0xFFFFFFFF
 #define SERVER_PORT 54321
+#define ROUND_INTERVAL_MS 3000
+#define NEIGHBOUR_TIMEOUT_ROUNDS 2
+#define PACING_BURST 8
+#define WITHDRAW_ROUNDS 3
+#define SEND_RETRY_MS 1
+#define CHECKPOINT_MAGIC 0x52544350
+#define CHECKPOINT_VERSION 2
+#define HELLO_MULTIPLIER 3
 
 struct routing_record {
   char address[IP_ADDR_LENGTH];
@@ -34,6 +48,8 @@ struct neighbour {
   char address[IP_ADDR_LENGTH];
   uint32_t distance;
   uint32_t rounds_since_responded;
+  long long last_hello_ms;
+  uint32_t hello_detect_ms; // 0 until the neighbour's first hello
 };
 
 struct neighbour neighbours[MAX_TABLE_LENGTH];
@@ -45,6 +61,59 @@ uint32_t number_of_direct_networks = 0;
 struct routing_record table[MAX_TABLE_LENGTH];
 uint32_t table_length = 0;
 
+// Layout of the checkpoint file. Bump CHECKPOINT_VERSION whenever any of the
+// stored structures change, older files are then ignored on startup.
+struct checkpoint {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t generation;
+  uint32_t checksum;
+  uint32_t table_length;
+  uint32_t number_of_neighbours;
+  struct routing_record table[MAX_TABLE_LENGTH];
+  struct neighbour neighbours[MAX_TABLE_LENGTH];
+};
+
+struct checkpoint *checkpoint = NULL;
+
+// Export state of a single interface. Every round the whole exported table
+// is queued and then drained at pacing_rate messages per second. The cursor
+// is kept across rounds, so when the rate is too low to drain a round, the
+// next one continues with the records that were not sent yet.
+struct interface_queue {
+  struct sockaddr_in broadcast_addr;
+  bool is_valid;
+  double tokens;
+  long long last_refill_ms;
+  uint32_t next_record;
+  uint32_t remaining;
+};
+
+struct interface_queue queues[MAX_TABLE_LENGTH];
+// Room for the table and for as many withdrawn aggregates.
+struct routing_record export_table[2 * MAX_TABLE_LENGTH];
+uint32_t export_length = 0;
+
+// An aggregate that is no longer exported is advertised as unreachable for a
+// few rounds. Routes never age out, so neighbours would keep it otherwise.
+struct withdrawal {
+  struct routing_record record;
+  uint32_t rounds_left;
+};
+
+struct routing_record last_aggregates[MAX_TABLE_LENGTH];
+uint32_t number_of_last_aggregates = 0;
+struct withdrawal withdrawals[MAX_TABLE_LENGTH];
+uint32_t number_of_withdrawals = 0;
+
+uint32_t update_jitter_ms = 500;
+double pacing_rate = 100.0;
+int socket_buffer_size = 0;
+uint32_t receive_queue_drops = 0;
+uint32_t hello_interval_ms = 0;
+uint32_t hello_multiplier = HELLO_MULTIPLIER;
+long long next_hello_ms = 0;
+
 void struct_to_string(struct routing_record record, char *message) {
   snprintf(message, BUF_SIZE, "%s/%d distance %d", record.address, record.mask,
            record.distance);
@@ -66,6 +135,23 @@ bool are_the_same_addr_of_network(const char *ip1, const char *ip2,
   uint32_t netmask = (0xFFFFFFFF << (32 - mask));
   return ((num1 & netmask) == (num2 & netmask));
 }
+
+uint32_t address_to_uint(const char *address) {
+  struct in_addr addr;
+  if (inet_pton(AF_INET, address, &addr) != 1)
+    return 0;
+  return ntohl(addr.s_addr);
+}
+
+void uint_to_address(uint32_t num, char *address) {
+  struct in_addr addr;
+  addr.s_addr = htonl(num);
+  inet_ntop(AF_INET, &addr, address, IP_ADDR_LENGTH);
+}
+
+uint32_t netmask_of(uint32_t mask) {
+  return mask == 0 ? 0 : 0xFFFFFFFF << (32 - mask);
+}
 void handle_configuration(char *message) {
   char address[IP_ADDR_LENGTH];
   uint32_t mask;
@@ -237,56 +323,223 @@ char *calculate_broadcast_address(const char *ip_address, uint32_t mask) {
   return broadcast_str;
 }
 
-bool send_udp_broadcast(const char *ip_address, uint32_t mask,
-                        const char *message, int *sockfd) {
-  struct sockaddr_in server_addr;
-
-  char *broadcast_ip = calculate_broadcast_address(ip_address, mask);
-  if (broadcast_ip == NULL) {
-    fprintf(stderr, "Error calculating broadcast address.\n");
+// Two learned prefixes can be advertised as their parent only if they are the
+// two halves of it and neighbours would route both of them the same way.
+bool can_aggregate(const struct routing_record *a,
+                   const struct routing_record *b) {
+  if (a->mask != b->mask || a->mask < 2)
     return false;
+  if (a->distance != b->distance || a->distance == INF_DIST)
+    return false;
+  if (strcmp(a->via, b->via) != 0)
+    return false;
+  // Neighbours are discovered through the exact prefix of a shared network,
+  // so directly connected networks are always exported as they are.
+  if (strcmp(a->via, "directly") == 0 || strcmp(a->via, "direct") == 0)
+    return false;
+  uint32_t net_a = address_to_uint(a->address) & netmask_of(a->mask);
+  uint32_t net_b = address_to_uint(b->address) & netmask_of(b->mask);
+  return (net_a ^ net_b) == (1U << (32 - a->mask));
+}
+
+// Builds the list of records advertised to neighbours. Sibling prefixes with
+// the same next hop and distance are merged into their covering prefix, as
+// long as the covering prefix is not routed on its own. Unreachable records
+// are never merged, so withdrawals still reach every specific prefix.
+uint32_t aggregate_table(struct routing_record *export_table) {
+  uint32_t export_length = table_length;
+  for (uint32_t i = 0; i < table_length; i++) {
+    export_table[i] = table[i];
+    uint_to_address(address_to_uint(table[i].address) &
+                        netmask_of(table[i].mask),
+                    export_table[i].address);
   }
 
-  memset(&server_addr, 0, sizeof(server_addr));
-  server_addr.sin_family = AF_INET;
-  server_addr.sin_port = htons(SERVER_PORT);
-  if (inet_pton(AF_INET, broadcast_ip, &server_addr.sin_addr) <= 0) {
-    perror("inet_pton failed");
-    free(broadcast_ip);
-    return false;
+  bool merged = true;
+  while (merged) {
+    merged = false;
+    for (uint32_t i = 0; i < export_length && !merged; i++) {
+      for (uint32_t j = i + 1; j < export_length && !merged; j++) {
+        if (!can_aggregate(&export_table[i], &export_table[j]))
+          continue;
+
+        uint32_t parent_mask = export_table[i].mask - 1;
+        uint32_t parent = address_to_uint(export_table[i].address) &
+                          netmask_of(parent_mask);
+        bool is_routed = false;
+        for (uint32_t k = 0; k < export_length; k++)
+          if (export_table[k].mask == parent_mask &&
+              address_to_uint(export_table[k].address) == parent)
+            is_routed = true;
+        if (is_routed)
+          continue;
+
+        export_table[i].mask = parent_mask;
+        uint_to_address(parent, export_table[i].address);
+        for (uint32_t k = j; k < export_length - 1; k++)
+          export_table[k] = export_table[k + 1];
+        export_length--;
+        merged = true;
+      }
+    }
   }
+  return export_length;
+}
 
-  if (sendto(*sockfd, message, strlen(message), 0,
-             (const struct sockaddr *)&server_addr,
-             sizeof(server_addr)) == -1) {
-    perror("sendto failed");
-    free(broadcast_ip);
-    return false;
+bool contains_prefix(const struct routing_record *records, uint32_t length,
+                     const struct routing_record *record) {
+  for (uint32_t i = 0; i < length; i++)
+    if (records[i].mask == record->mask &&
+        ((address_to_uint(records[i].address) ^
+          address_to_uint(record->address)) &
+         netmask_of(record->mask)) == 0)
+      return true;
+  return false;
+}
+
+// Appends withdrawals of the aggregates exported last round that are gone
+// now. A prefix exported again is no longer withdrawn.
+uint32_t withdraw_aggregates(struct routing_record *export_table,
+                             uint32_t export_length) {
+  uint32_t kept = 0;
+  for (uint32_t i = 0; i < number_of_withdrawals; i++)
+    if (!contains_prefix(export_table, export_length,
+                         &withdrawals[i].record))
+      withdrawals[kept++] = withdrawals[i];
+  number_of_withdrawals = kept;
+
+  for (uint32_t i = 0; i < number_of_last_aggregates; i++) {
+    struct routing_record *gone = &last_aggregates[i];
+    bool is_withdrawn = false;
+    for (uint32_t j = 0; j < number_of_withdrawals; j++)
+      if (withdrawals[j].record.mask == gone->mask &&
+          strcmp(withdrawals[j].record.address, gone->address) == 0)
+        is_withdrawn = true;
+    if (is_withdrawn || number_of_withdrawals == MAX_TABLE_LENGTH ||
+        contains_prefix(export_table, export_length, gone))
+      continue;
+    withdrawals[number_of_withdrawals].record = *gone;
+    withdrawals[number_of_withdrawals].record.distance = INF_DIST;
+    withdrawals[number_of_withdrawals].rounds_left = WITHDRAW_ROUNDS;
+    number_of_withdrawals++;
   }
 
-  free(broadcast_ip);
-  return true;
+  number_of_last_aggregates = 0;
+  for (uint32_t i = 0; i < export_length; i++)
+    if (!contains_prefix(table, table_length, &export_table[i]))
+      last_aggregates[number_of_last_aggregates++] = export_table[i];
+
+  kept = 0;
+  for (uint32_t i = 0; i < number_of_withdrawals; i++) {
+    export_table[export_length++] = withdrawals[i].record;
+    if (--withdrawals[i].rounds_left > 0)
+      withdrawals[kept++] = withdrawals[i];
+  }
+  number_of_withdrawals = kept;
+  return export_length;
+}
+
+long long now_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
 }
 
-void send_table(int *sockfd) {
+void mark_network_unavailable(uint32_t network) {
+  for (uint32_t n = 0; n < number_of_neighbours; n++)
+    if (are_the_same_addr_of_network(neighbours[n].address,
+                                     direct_networks[network].address,
+                                     direct_networks[network].mask))
+      neighbours[n].rounds_since_responded = NEIGHBOUR_TIMEOUT_ROUNDS + 1;
+}
+
+// Snapshots the exported table and queues it on every interface.
+void start_update() {
+  export_length = aggregate_table(export_table);
+  export_length = withdraw_aggregates(export_table, export_length);
+  long long now = now_ms();
   for (uint32_t i = 0; i < number_of_direct_networks; i++) {
-    char broadcast_ip[IP_ADDR_LENGTH];
-    strcpy(broadcast_ip, calculate_broadcast_address(direct_networks[i].address,
-                                                     direct_networks[i].mask));
-    for (uint32_t j = 0; j < table_length; j++) {
+    struct interface_queue *queue = &queues[i];
+    char *broadcast_ip = calculate_broadcast_address(
+        direct_networks[i].address, direct_networks[i].mask);
+    memset(&queue->broadcast_addr, 0, sizeof(queue->broadcast_addr));
+    queue->broadcast_addr.sin_family = AF_INET;
+    queue->broadcast_addr.sin_port = htons(SERVER_PORT);
+    queue->is_valid = broadcast_ip != NULL &&
+                      inet_pton(AF_INET, broadcast_ip,
+                                &queue->broadcast_addr.sin_addr) == 1;
+    free(broadcast_ip);
+    if (queue->last_refill_ms == 0) {
+      queue->tokens = PACING_BURST;
+      queue->last_refill_ms = now;
+    }
+    queue->remaining = export_length;
+  }
+}
+
+// Sends as much of the queued update as the token buckets allow. Returns the
+// number of milliseconds, at least 1, until more tokens are needed or a full
+// send buffer is worth retrying, or -1 if nothing is left to send.
+long long send_paced(int sockfd) {
+  long long now = now_ms();
+  long long wait_ms = -1;
+  for (uint32_t i = 0; i < number_of_direct_networks; i++) {
+    struct interface_queue *queue = &queues[i];
+    if (!queue->is_valid || queue->remaining == 0)
+      continue;
+
+    queue->tokens += (now - queue->last_refill_ms) * pacing_rate / 1000.0;
+    if (queue->tokens > PACING_BURST)
+      queue->tokens = PACING_BURST;
+    queue->last_refill_ms = now;
+
+    bool is_stalled = false;
+    while (queue->tokens >= 1.0 && queue->remaining > 0) {
       char message[BUF_SIZE];
-      struct_to_string(table[j], message);
-      int is_fail = send_udp_broadcast(broadcast_ip, direct_networks[i].mask,
-                                       message, sockfd);
-      if (is_fail == -1) {
-        for (uint32_t n = 0; n < number_of_neighbours; n++)
-          if (are_the_same_addr_of_network(neighbours[n].address,
-                                           direct_networks[i].address,
-                                           direct_networks[i].mask))
-            neighbours[n].rounds_since_responded = INF_DIST;
+      if (queue->next_record >= export_length)
+        queue->next_record = 0;
+      struct_to_string(export_table[queue->next_record], message);
+      if (sendto(sockfd, message, strlen(message), MSG_DONTWAIT,
+                 (const struct sockaddr *)&queue->broadcast_addr,
+                 sizeof(queue->broadcast_addr)) == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+          is_stalled = true;
+          break;
+        }
+        perror("sendto failed");
+        mark_network_unavailable(i);
+        queue->remaining = 0;
+        break;
       }
+      queue->tokens -= 1.0;
+      queue->next_record++;
+      queue->remaining--;
+    }
+
+    // A full send buffer is retried shortly even if tokens are left.
+    if (queue->remaining > 0) {
+      long long refill_ms = SEND_RETRY_MS;
+      if (!is_stalled && queue->tokens < 1.0)
+        refill_ms = (long long)((1.0 - queue->tokens) * 1000.0 / pacing_rate) + 1;
+      if (wait_ms == -1 || refill_ms < wait_ms)
+        wait_ms = refill_ms;
     }
   }
+  return wait_ms;
+}
+
+// A hello carries the sender's interval and multiplier. Their product is how
+// long the sender may stay silent before we declare it dead, as in BFD.
+void handle_hello(char *sender, char *message) {
+  uint32_t interval, multiplier;
+  if (sscanf(message, "hello %u %u", &interval, &multiplier) != 2 ||
+      interval == 0 || multiplier == 0)
+    return;
+  for (uint32_t i = 0; i < number_of_neighbours; i++)
+    if (strcmp(neighbours[i].address, sender) == 0) {
+      neighbours[i].last_hello_ms = now_ms();
+      neighbours[i].hello_detect_ms = interval * multiplier;
+    }
 }
 
 void receive(int sockfd) {
@@ -312,10 +565,15 @@ void receive(int sockfd) {
   while (1) {
     char buffer[BUF_SIZE];
     struct sockaddr_in client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    ssize_t bytes_received =
-        recvfrom(sockfd, buffer, BUF_SIZE, MSG_DONTWAIT,
-                 (struct sockaddr *)&client_addr, &client_len);
+    char control[CMSG_SPACE(sizeof(uint32_t))];
+    struct iovec iov = {.iov_base = buffer, .iov_len = BUF_SIZE - 1};
+    struct msghdr msg = {.msg_name = &client_addr,
+                         .msg_namelen = sizeof(client_addr),
+                         .msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = control,
+                         .msg_controllen = sizeof(control)};
+    ssize_t bytes_received = recvmsg(sockfd, &msg, MSG_DONTWAIT);
     if (bytes_received < 0) {
       if (errno == EWOULDBLOCK || errno == EAGAIN)
         break;
@@ -326,8 +584,16 @@ void receive(int sockfd) {
       return;
     }
 
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg))
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL)
+        memcpy(&receive_queue_drops, CMSG_DATA(cmsg), sizeof(uint32_t));
+
     buffer[bytes_received] = '\0';
-    handle_routing_entry(inet_ntoa(client_addr.sin_addr), buffer);
+    if (strncmp(buffer, "hello ", 6) == 0)
+      handle_hello(inet_ntoa(client_addr.sin_addr), buffer);
+    else
+      handle_routing_entry(inet_ntoa(client_addr.sin_addr), buffer);
   }
 }
 
@@ -338,19 +604,234 @@ void handle_unavailable_neighbour(uint32_t id) {
       table[i].distance = INF_DIST;
 }
 
+// Sends a hello to every neighbour when the interval is up and drops the
+// neighbours whose hellos stopped. A dropped neighbour triggers an update
+// right away, so the rest of the network learns about it without waiting for
+// the next round. Returns the number of milliseconds until the next hello or
+// deadline, or -1 if there is none.
+long long run_hellos(int sockfd) {
+  long long now = now_ms();
+  long long wait_ms = -1;
+  if (hello_interval_ms > 0) {
+    if (now >= next_hello_ms) {
+      char message[BUF_SIZE];
+      snprintf(message, BUF_SIZE, "hello %u %u", hello_interval_ms,
+               hello_multiplier);
+      for (uint32_t i = 0; i < number_of_neighbours; i++) {
+        struct sockaddr_in addr = {.sin_family = AF_INET,
+                                   .sin_port = htons(SERVER_PORT)};
+        if (inet_pton(AF_INET, neighbours[i].address, &addr.sin_addr) != 1)
+          continue;
+        if (sendto(sockfd, message, strlen(message), MSG_DONTWAIT,
+                   (const struct sockaddr *)&addr, sizeof(addr)) == -1 &&
+            errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS &&
+            neighbours[i].distance != INF_DIST) {
+          perror("sendto hello failed");
+          neighbours[i].hello_detect_ms = 0;
+          handle_unavailable_neighbour(i);
+          start_update();
+        }
+      }
+      next_hello_ms = now + hello_interval_ms;
+    }
+    wait_ms = next_hello_ms - now;
+  }
+
+  for (uint32_t i = 0; i < number_of_neighbours; i++) {
+    struct neighbour *n = &neighbours[i];
+    if (n->hello_detect_ms == 0 || n->distance == INF_DIST)
+      continue;
+    long long left = n->last_hello_ms + n->hello_detect_ms - now;
+    if (left < 0) {
+      printf("Neighbour %s missed hellos for %u ms\n", n->address,
+             n->hello_detect_ms);
+      n->hello_detect_ms = 0;
+      handle_unavailable_neighbour(i);
+      start_update();
+      wait_ms = 0;
+    } else if (wait_ms == -1 || left < wait_ms) {
+      wait_ms = left;
+    }
+  }
+  return wait_ms;
+}
+
+uint32_t checkpoint_checksum(const struct checkpoint *cp) {
+  const unsigned char *bytes = (const unsigned char *)cp->table;
+  size_t length = sizeof(cp->table) + sizeof(cp->neighbours);
+  uint32_t hash = 2166136261U;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= bytes[i];
+    hash *= 16777619U;
+  }
+  return hash ^ cp->table_length ^ (cp->number_of_neighbours << 16);
+}
+
+bool open_checkpoint(const char *path) {
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd == -1) {
+    perror("open checkpoint failed");
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 ||
+      ((size_t)st.st_size != sizeof(struct checkpoint) &&
+       ftruncate(fd, sizeof(struct checkpoint)) == -1)) {
+    perror("resizing checkpoint failed");
+    close(fd);
+    return false;
+  }
+
+  void *mapped = mmap(NULL, sizeof(struct checkpoint), PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    perror("mmap checkpoint failed");
+    return false;
+  }
+  checkpoint = mapped;
+  return true;
+}
+
+uint32_t direct_network_of(const char *address) {
+  uint32_t i;
+  for (i = 0; i < number_of_direct_networks; i++)
+    if (are_the_same_addr_of_network(address, direct_networks[i].address,
+                                     direct_networks[i].mask))
+      break;
+  return i;
+}
+
+// Restores neighbours and learned routes saved by a previous run. They are
+// treated as if the neighbour has just responded, so routes keep forwarding
+// right away and are dropped by the usual timeout if nobody confirms them.
+// Direct networks always come from the configuration on stdin.
+void load_checkpoint() {
+  if (checkpoint->magic != CHECKPOINT_MAGIC ||
+      checkpoint->version != CHECKPOINT_VERSION ||
+      checkpoint->table_length > MAX_TABLE_LENGTH ||
+      checkpoint->number_of_neighbours > MAX_TABLE_LENGTH ||
+      checkpoint->checksum != checkpoint_checksum(checkpoint))
+    return;
+
+  for (uint32_t i = 0; i < checkpoint->number_of_neighbours &&
+                       number_of_neighbours < MAX_TABLE_LENGTH;
+       i++) {
+    struct neighbour saved = checkpoint->neighbours[i];
+    saved.address[IP_ADDR_LENGTH - 1] = '\0';
+    uint32_t idx = direct_network_of(saved.address);
+    if (saved.distance == INF_DIST || idx == number_of_direct_networks)
+      continue;
+    saved.distance = direct_networks[idx].distance;
+    saved.rounds_since_responded = 0;
+    saved.last_hello_ms = 0;
+    saved.hello_detect_ms = 0;
+    neighbours[number_of_neighbours] = saved;
+    number_of_neighbours++;
+  }
+
+  uint32_t restored = 0;
+  for (uint32_t i = 0;
+       i < checkpoint->table_length && table_length < MAX_TABLE_LENGTH; i++) {
+    struct routing_record saved = checkpoint->table[i];
+    saved.address[IP_ADDR_LENGTH - 1] = '\0';
+    saved.via[IP_ADDR_LENGTH - 1] = '\0';
+    if (saved.distance == INF_DIST || saved.mask > 32)
+      continue;
+
+    bool via_neighbour = false;
+    for (uint32_t n = 0; n < number_of_neighbours; n++)
+      if (strcmp(neighbours[n].address, saved.via) == 0)
+        via_neighbour = true;
+    if (!via_neighbour)
+      continue;
+
+    bool is_known = false;
+    for (uint32_t j = 0; j < table_length; j++)
+      if (table[j].mask == saved.mask &&
+          are_the_same_addr_of_network(table[j].address, saved.address,
+                                       saved.mask))
+        is_known = true;
+    if (is_known)
+      continue;
+
+    table[table_length] = saved;
+    table_length++;
+    restored++;
+  }
+  printf("Restored %d routes from checkpoint generation %d\n", restored,
+         checkpoint->generation);
+}
+
+void save_checkpoint() {
+  memset(checkpoint->table, 0, sizeof(checkpoint->table));
+  memset(checkpoint->neighbours, 0, sizeof(checkpoint->neighbours));
+  memcpy(checkpoint->table, table, table_length * sizeof(table[0]));
+  memcpy(checkpoint->neighbours, neighbours,
+         number_of_neighbours * sizeof(neighbours[0]));
+  checkpoint->table_length = table_length;
+  checkpoint->number_of_neighbours = number_of_neighbours;
+  checkpoint->checksum = checkpoint_checksum(checkpoint);
+  checkpoint->generation++;
+  checkpoint->version = CHECKPOINT_VERSION;
+  checkpoint->magic = CHECKPOINT_MAGIC;
+  msync(checkpoint, sizeof(struct checkpoint), MS_ASYNC);
+}
+
+void wait_for_socket(int sockfd, long long timeout_ms) {
+  fd_set read_fds;
+  FD_ZERO(&read_fds);
+  FD_SET(sockfd, &read_fds);
+
+  struct timeval timeout;
+  timeout.tv_sec = timeout_ms / 1000;
+  timeout.tv_usec = (timeout_ms % 1000) * 1000;
+  if (select(sockfd + 1, &read_fds, NULL, NULL, &timeout) == -1 &&
+      errno != EINTR)
+    perror("select failed");
+}
+
+// Rounds are ROUND_INTERVAL_MS apart, shifted by a random jitter so that
+// routers started together do not keep broadcasting at the same moment.
+long long next_round_delay() {
+  if (update_jitter_ms == 0)
+    return ROUND_INTERVAL_MS;
+  long long spread = 2LL * update_jitter_ms + 1;
+  return ROUND_INTERVAL_MS - update_jitter_ms + rand() % spread;
+}
+
 void loop(int sockfd) {
+  long long next_round_ms = now_ms();
   while (1) {
-    for (uint32_t i = 0; i < number_of_neighbours; i++)
-      neighbours[i].rounds_since_responded++;
-    receive(sockfd);
-    send_table(&sockfd);
-    print_table();
-    // print_neighbours();
-    for (uint32_t i = 0; i < number_of_neighbours; i++)
-      if (neighbours[i].rounds_since_responded > 2)
-        handle_unavailable_neighbour(i);
+    if (now_ms() >= next_round_ms) {
+      for (uint32_t i = 0; i < number_of_neighbours; i++)
+        neighbours[i].rounds_since_responded++;
+      receive(sockfd);
+      start_update();
+      print_table();
+      // print_neighbours();
+      if (receive_queue_drops > 0)
+        printf("Updates dropped by the receive queue: %u\n",
+               receive_queue_drops);
+      for (uint32_t i = 0; i < number_of_neighbours; i++)
+        if (neighbours[i].rounds_since_responded > NEIGHBOUR_TIMEOUT_ROUNDS)
+          handle_unavailable_neighbour(i);
+      if (checkpoint != NULL)
+        save_checkpoint();
+      next_round_ms = now_ms() + next_round_delay();
+    }
 
-    sleep(3);
+    long long timeout_ms = next_round_ms - now_ms();
+    long long pacing_ms = send_paced(sockfd);
+    if (pacing_ms != -1 && pacing_ms < timeout_ms)
+      timeout_ms = pacing_ms;
+    long long hello_ms = run_hellos(sockfd);
+    if (hello_ms != -1 && hello_ms < timeout_ms)
+      timeout_ms = hello_ms;
+    if (timeout_ms > 0)
+      wait_for_socket(sockfd, timeout_ms);
+    receive(sockfd);
   }
 }
 
@@ -370,6 +851,18 @@ int create_socket() {
     exit(EXIT_FAILURE);
   }
 
+  int report_overflow = 1;
+  if (setsockopt(sockfd, SOL_SOCKET, SO_RXQ_OVFL, &report_overflow,
+                 sizeof(report_overflow)) == -1)
+    perror("setsockopt SO_RXQ_OVFL failed");
+
+  if (socket_buffer_size > 0 &&
+      (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &socket_buffer_size,
+                  sizeof(socket_buffer_size)) == -1 ||
+       setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &socket_buffer_size,
+                  sizeof(socket_buffer_size)) == -1))
+    perror("setsockopt buffer size failed");
+
   memset(&server_addr, 0, sizeof(server_addr));
   server_addr.sin_family = AF_INET;
   server_addr.sin_addr.s_addr = INADDR_ANY;
@@ -405,9 +898,50 @@ void input() {
   }
 }
 
-int main() {
+int main(int argc, char *argv[]) {
+  const char *checkpoint_path = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "c:j:r:b:i:m:")) != -1) {
+    switch (opt) {
+    case 'c':
+      checkpoint_path = optarg;
+      break;
+    case 'j':
+      update_jitter_ms = atoi(optarg);
+      if (update_jitter_ms >= ROUND_INTERVAL_MS)
+        update_jitter_ms = ROUND_INTERVAL_MS - 1;
+      break;
+    case 'r':
+      pacing_rate = atof(optarg);
+      if (pacing_rate <= 0)
+        pacing_rate = 100.0;
+      break;
+    case 'b':
+      socket_buffer_size = atoi(optarg);
+      break;
+    case 'i':
+      hello_interval_ms = atoi(optarg);
+      break;
+    case 'm':
+      hello_multiplier = atoi(optarg);
+      if (hello_multiplier == 0)
+        hello_multiplier = HELLO_MULTIPLIER;
+      break;
+    default:
+      fprintf(stderr,
+              "Usage: %s [-c checkpoint_file] [-j jitter_ms] "
+              "[-r messages_per_second] [-b socket_buffer_bytes] "
+              "[-i hello_interval_ms] [-m hello_multiplier]\n",
+              argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  srand(time(NULL) ^ getpid());
+
   int sockfd = create_socket();
   input();
+  if (checkpoint_path != NULL && open_checkpoint(checkpoint_path))
+    load_checkpoint();
   loop(sockfd);
   close(sockfd);
 }
@@ -0,0 +1,91 @@
+#!/bin/sh
+# Traces a list of targets through simulated topologies (-S, no root or
+# network needed) in several modes and reports wall time, traces per second,
+# hops per trace, the share of hops identified correctly and the mean RTT
+# error against the topology.
+#
+# Usage: ./bench.sh [targets] [traceroute options...]
+# Topologies are "name|line;line;..." entries in $SCENARIOS and modes are
+# "name|options" entries in $MODES, in the format described in traceroute.c.
+# Probes are not paced (-r 0) unless the options say otherwise; the sequential
+# modes wait out every silent hop, so keep the target count small.
+
+TARGETS=${1:-20}
+[ $# -gt 0 ] && shift
+
+SCENARIOS=${SCENARIOS:-"clean|router 10.0.0.1 1 0 0 0;router 10.0.0.2 2 0 0 0;router 10.0.0.3 4 0 0 0;router 10.0.0.4 6 0 0 0;target 8 0 0
+silent hops|router 10.0.0.1 1 0 0 0;router * 0 0 0 0;router 10.0.0.3 4 0 0 0;router * 0 0 0 0;router 10.0.0.5 8 0 0 0;target 10 0 0
+lossy|router 10.0.0.1 1 0.5 0.05 0;router 10.0.0.2 3 1 0.1 0;router 10.0.0.3 5 2 0.2 0;target 8 2 0.05
+rate limited|router 10.0.0.1 1 0 0 100;router 10.0.0.2 2 0 0 50;router 10.0.0.3 4 0 0 20;target 6 0 0
+long haul|router 10.0.0.1 1 0.5 0 0;router 10.0.0.2 20 2 0 0;router 10.0.0.3 90 5 0.01 0;router 10.0.0.4 150 5 0 0;target 160 5 0"}
+
+MODES=${MODES:-"sequential|-w 1 -c 1
+parallel|-c 1
+adaptive|-c 1 -t 5:1000
+batch|-c 64
+batch adaptive|-c 64 -t 5:1000"}
+
+cd "$(dirname "$0")" || exit 1
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+i=0
+while [ "$i" -lt "$TARGETS" ]; do
+  echo "10.200.$((i / 250)).$((i % 250 + 1))"
+  i=$((i + 1))
+done > "$WORK/targets"
+
+printf "%-14s %-15s %8s %9s %8s %9s %9s\n" scenario mode time_s traces/s \
+  hops hops_ok rtt_err_ms
+
+echo "$SCENARIOS" | while IFS='|' read -r name topology; do
+  [ -z "$name" ] && continue
+  echo "$topology" | tr ';' '\n' > "$WORK/topology"
+  echo "$MODES" | while IFS='|' read -r mode options; do
+    [ -z "$mode" ] && continue
+    start=$(date +%s%N)
+    # shellcheck disable=SC2086
+    timeout 600 ./traceroute -S "$WORK/topology" -f "$WORK/targets" \
+      -r 0 $options "$@" > "$WORK/traces"
+    end=$(date +%s%N)
+
+    # Each reply is checked against the hop it came from: a router must be at
+    # its TTL and the target just past the last router. The mean absolute RTT
+    # error is measured from the middle of the hop's jitter range.
+    awk -v name="$name" -v mode="$mode" -v ns=$((end - start)) \
+        -v traces="$TARGETS" '
+      FNR == NR {
+        if ($1 == "router") { routers++; addr[routers] = $2; rtt[routers] = $3 + $4 / 2 }
+        else if ($1 == "target") target_rtt = $2 + $3 / 2
+        next
+      }
+      {
+        n = split($0, hops, /\],\[/)
+        reported += n
+        for (ttl = 1; ttl <= n; ttl++) {
+          expected = ttl <= routers ? addr[ttl] : "target"
+          if (expected != "*") total++
+          found = 0
+          rest = hops[ttl]
+          while (match(rest, /"addr":"[^"]*","rtt":[0-9.]*/)) {
+            reply = substr(rest, RSTART + 8, RLENGTH - 8)
+            rest = substr(rest, RSTART + RLENGTH)
+            split(reply, f, /","rtt":/)
+            is_target = ttl > routers && index($0, "\"target\":\"" f[1] "\"") > 0
+            if (f[1] == expected || is_target) {
+              found = 1
+              difference = f[2] - (is_target ? target_rtt : rtt[ttl])
+              error += difference < 0 ? -difference : difference
+              samples++
+            }
+          }
+          correct += found
+        }
+      }
+      END {
+        t = ns / 1e9
+        printf "%-14s %-15s %8.2f %9.1f %8.1f %8.1f%% %9.3f\n", name, mode, t,
+               traces / t, reported / traces, total ? 100 * correct / total : 0,
+               samples ? error / samples : 0
+      }' "$WORK/topology" "$WORK/traces"
+  done
+done
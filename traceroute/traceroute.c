@@ -1,4 +1,4 @@
-#define _POSIX_C_SOURCE 199309L
+#define _GNU_SOURCE
 
 #include <arpa/inet.h>
 #include <errno.h>
@@ -13,7 +13,153 @@
 #include <time.h>
 #include <sys/select.h>
 #include <strings.h>
+#include <linux/errqueue.h>
+#include <linux/filter.h>
+#include <math.h>
+#include <signal.h>
+#include <linux/net_tstamp.h>
 
+#define MAX_TTL 30
+#define PROBES_PER_TTL 3
+#define TIMEOUT_MS 1000
+#define TIMEOUT_FACTOR 3        // czas oczekiwania w trybie adaptacyjnym: 3 x RTT
+#define HOP_MARGIN_MS 50        // zapas na każdy skok za ostatnim, który odpowiedział
+#define MAX_SLOTS 512           // 9 bitów numeru sekwencyjnego
+#define SLOT_SHIFT 7            // pozostałe 7 bitów to ttl * 3 + i
+#define DEFAULT_CONCURRENCY 64
+#define DEFAULT_RATE 1000       // sondy na sekundę w trybie wsadowym
+#define RECEIVE_BUFFER (4 << 20)
+#define SEND_BATCH 64
+#define TX_KEYS 8192            // sondy czekające na znacznik czasu wysłania
+#define DEFAULT_INTERVAL_MS 1000
+#define HISTOGRAM_BUCKETS 192   // 8 na oktawę od 1 µs do ~16 s
+#define HISTOGRAM_BASE_MS 0.001
+#define SAMPLE_STRIDE 4         // w trybie przyrostowym sprawdzany jest co czwarty skok
+#define RETRACE_MARGIN 2        // TTL ponad zapamiętaną długość trasy w drodze przy ponownym śledzeniu
+#define ALL_TTLS (((1U << MAX_TTL) - 1) << 1)
+#define SIM_MAX_PENDING 65536
+#define SIM_PACKET_SIZE 64
+
+// `sent` (CLOCK_MONOTONIC) służy do liczenia terminów, RTT liczone jest ze
+// znaczników jądra w CLOCK_REALTIME: `sent_at` to moment przekazania sondy
+// do sterownika, `received_at` moment odebrania odpowiedzi przez jądro.
+typedef struct Probe {
+    struct timespec sent;
+    struct timespec sent_at;
+    struct timespec received_at;
+    u_int32_t tx_key;
+    double rtt;                       // -1, jeśli nie było odpowiedzi
+    int response_type;
+    char responder[INET_ADDRSTRLEN];
+    bool is_pending;
+} Probe;
+
+// Stan jednego śledzenia trasy. Numer sekwencyjny sondy to
+// slot << SLOT_SHIFT | (ttl * 3 + i), więc odpowiedzi da się przypisać do
+// celu i sondy niezależnie od kolejności nadejścia.
+typedef struct Trace {
+    bool is_active;
+    char target[INET_ADDRSTRLEN];
+    struct sockaddr_in recipient;
+    struct icmphdr template;    // nagłówek echo z sumą kontrolną dla sekwencji 0
+    Probe probes[MAX_TTL + 1][PROBES_PER_TTL];
+    int next_ttl;       // najmniejszy TTL, dla którego nie wysłano jeszcze sond
+    int printed_ttl;    // ostatni rozstrzygnięty TTL
+    int reached_ttl;    // TTL, na którym odpowiedział cel, albo MAX_TTL
+    double hop_rtt[MAX_TTL + 1]; // największe RTT każdego skoku, 0 bez odpowiedzi
+    u_int32_t ttl_mask; // bit ttl ustawiony, jeśli TTL ma być sondowany
+    int probes_sent;
+    int cached;         // indeks trasy w pamięci podręcznej albo -1
+    int retrace_from;   // TTL, od którego trasa jest śledzona od nowa, 0 w fazie próbkowania
+    int window;         // najwięcej TTL ponad rozstrzygnięte naraz w drodze, 0 bez własnego limitu
+} Trace;
+
+// Zapamiętana trasa do celu: kto odpowiadał na kolejnych TTL (INADDR_ANY dla
+// cichych skoków) i w jakiej klasie RTT, tj. floor(log2(1 + RTT w ms)).
+typedef struct PathEntry {
+    struct in_addr target;
+    int runs;
+    bool is_reached;
+    int hops;
+    struct in_addr responders[MAX_TTL + 1];
+    int rtt_class[MAX_TTL + 1];
+} PathEntry;
+
+// Trasy z poprzednich uruchomień. Wpisy wczytane z pliku są posortowane po
+// adresie celu, nowe są dopisywane na końcu i sortowane przy zapisie.
+typedef struct PathCache {
+    char *path;
+    PathEntry *entries;
+    int count;
+    int sorted;
+    int capacity;
+} PathCache;
+
+// Statystyki skoku w trybie ciągłym. Pamięć nie rośnie z liczbą próbek:
+// percentyle są szacowane z histogramu o logarytmicznych przedziałach
+// (błąd do ok. 4%), a jitter to wygładzona różnica kolejnych RTT (RFC 3550).
+typedef struct HopStats {
+    char responder[INET_ADDRSTRLEN];
+    long sent;
+    long received;
+    double last;
+    double min;
+    double max;
+    double sum;
+    double jitter;
+    u_int32_t histogram[HISTOGRAM_BUCKETS];
+} HopStats;
+
+// Sondy czekające na wysłanie jednym sendmmsg. TTL każdej z nich jest
+// przekazywany w komunikacie kontrolnym IP_TTL, bez setsockopt na sondę.
+typedef struct TransmitQueue {
+    int count;
+    struct icmphdr headers[SEND_BATCH];
+    struct iovec iov[SEND_BATCH];
+    union {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control[SEND_BATCH];
+    struct mmsghdr msgs[SEND_BATCH];
+    Probe *probes[SEND_BATCH];
+} TransmitQueue;
+
+// Skąd silnik bierze sieć: gniazdo surowe albo symulowana topologia. Funkcje
+// zachowują się jak odpowiadające im wywołania systemowe: `send` jak sendmmsg,
+// `receive` zwraca -1 z EAGAIN, gdy nie ma odpowiedzi, a `wait` jak select
+// czeka najwyżej `timeout_ms` na odpowiedź.
+typedef struct Backend {
+    void *context;
+    int (*send)(void *context, struct mmsghdr *msgs, int count);
+    ssize_t (*receive)(void *context, unsigned char *buffer, struct sockaddr_in *sender, struct timespec *received_at);
+    bool (*receive_tx_timestamp)(void *context, u_int32_t *key, struct timespec *sent_at);
+    int (*wait)(void *context, double timeout_ms);
+    void (*close)(void *context);
+} Backend;
+
+// Wiele śledzeń naraz na jednym gnieździe. W trybie wsadowym cele są czytane
+// z `targets`, a każda zakończona trasa wypisywana jako jeden obiekt JSON.
+typedef struct Tracer {
+    Backend *backend;
+    Trace *traces;
+    int slots;
+    int active;
+    int window;
+    FILE *targets;
+    bool is_batch;
+    bool is_monitor;    // skoki trafiają tylko do statystyk
+    double rate;        // sondy na sekundę, 0 bez ograniczenia
+    double tokens;
+    struct timespec last_refill;
+    TransmitQueue queue;
+    u_int32_t next_tx_key;      // SOF_TIMESTAMPING_OPT_ID numeruje wysłane pakiety
+    Probe *tx_probes[TX_KEYS];
+    PathCache *cache;
+} Tracer;
+
+bool is_adaptive = false;
+double timeout_floor_ms;
+double timeout_ceiling_ms;
 
 u_int16_t compute_icmp_checksum(const void *buff, int length) {
     const u_int16_t *ptr = buff;
@@ -25,6 +171,14 @@ u_int16_t compute_icmp_checksum(const void *buff, int length) {
     return (u_int16_t)(~(sum + (sum >> 16U)));
 }
 
+// Aktualizacja sumy kontrolnej po zmianie jednego słowa, RFC 1624 (równanie 3):
+// HC' = ~(~HC + ~m + m').
+u_int16_t update_icmp_checksum(u_int16_t checksum, u_int16_t old_word, u_int16_t new_word) {
+    u_int32_t sum = (u_int16_t)~checksum + (u_int16_t)~old_word + new_word;
+    sum = (sum >> 16U) + (sum & 0xffff);
+    return (u_int16_t)~(sum + (sum >> 16U));
+}
+
 bool isValidIPAddress(char *ipAddress) {
     int num = 0, dotCount = 0, i;
     for (i = 0; ipAddress[i] != '\0'; i++) {
@@ -85,7 +239,7 @@ double sendPacket(int sockfd, int seqNum, int ttl, char* targetIpAddr, struct ti
     }
 
     // Wysyłanie pakietu
-    clock_gettime(CLOCK_MONOTONIC, start);
+    clock_gettime(CLOCK_REALTIME, start);
     ssize_t bytes_sent = sendto(
         sockfd,
         &header,
@@ -101,14 +255,109 @@ double sendPacket(int sockfd, int seqNum, int ttl, char* targetIpAddr, struct ti
     return start->tv_sec * 1000.0 + start->tv_nsec / 1000000.0;
 }
 
-double receivePacket(int sockfd, char* responseIpAddr, int* response_type, struct timespec *start, int seqNum) {
+// Filtr BPF, przez który do gniazda trafiają tylko odpowiedzi echo z naszym
+// identyfikatorem oraz komunikaty time exceeded i destination unreachable
+// cytujące nasze żądanie echo. Pozostałe pakiety ICMP hosta jądro odrzuca,
+// zanim cokolwiek zostanie skopiowane. Pakiet zaczyna się od nagłówka IP.
+void attachFilter(int sockfd) {
+    // ldh zwraca słowo w kolejności sieciowej, a identyfikator zapisujemy w
+    // kolejności hosta.
+    u_int16_t id = htons(getpid() & 0xFFFF);
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),                     // X = długość nagłówka IP
+        BPF_STMT(BPF_LD | BPF_B | BPF_IND, 0),                      // A = typ ICMP
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_ECHOREPLY, 0, 2),
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 4),                      // A = identyfikator
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, id, 11, 12),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_TIME_EXCEEDED, 1, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_DEST_UNREACH, 0, 10),
+        BPF_STMT(BPF_LD | BPF_B | BPF_IND, 8),                      // cytowany nagłówek IP
+        BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0xf),
+        BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 2),
+        BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),                            // X += jego długość
+        BPF_STMT(BPF_LD | BPF_B | BPF_IND, 8),                      // A = cytowany typ ICMP
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_ECHO, 0, 3),
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 12),                     // A = cytowany identyfikator
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, id, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, IP_MAXPACKET),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    struct sock_fprog program = {.len = sizeof(code) / sizeof(code[0]), .filter = code};
+    if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program)) < 0)
+        perror("setsockopt SO_ATTACH_FILTER failed");
+}
+
+// Znaczniki czasu odbioru nadawane przez jądro w chwili przyjęcia pakietu nie
+// obejmują opóźnień planisty ani czytania innych pakietów.
+void enableTimestamps(int sockfd, bool with_tx) {
+    int on = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0)
+        perror("setsockopt SO_TIMESTAMPNS failed");
+    if (!with_tx)
+        return;
+    int flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+                SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0)
+        perror("setsockopt SO_TIMESTAMPING failed");
+}
+
+// recvfrom, który dodatkowo zwraca znacznik czasu odbioru z jądra, a bez
+// niego bieżący czas (CLOCK_REALTIME).
+ssize_t receiveWithTimestamp(int sockfd, unsigned char *buffer, struct sockaddr_in *sender, struct timespec *received_at) {
+    union {
+        char buffer[CMSG_SPACE(sizeof(struct timespec))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {.iov_base = buffer, .iov_len = IP_MAXPACKET};
+    struct msghdr msg = {.msg_name = sender, .msg_namelen = sizeof(*sender),
+                         .msg_iov = &iov, .msg_iovlen = 1,
+                         .msg_control = control.buffer, .msg_controllen = sizeof(control.buffer)};
+    ssize_t packet_len = recvmsg(sockfd, &msg, MSG_DONTWAIT);
+    if (packet_len < 0)
+        return packet_len;
+    clock_gettime(CLOCK_REALTIME, received_at);
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+            memcpy(received_at, CMSG_DATA(cmsg), sizeof(*received_at));
+    return packet_len;
+}
+
+// Czas oczekiwania na odpowiedź skoku. Domyślnie stały, w trybie adaptacyjnym
+// liczony tylko z RTT, które ograniczają RTT tego skoku, w granicach
+// [floor, ceiling]:
+//  - `later_rtt` to największe RTT tego lub dalszego skoku (albo celu); droga
+//    przez ten skok trwa najwyżej tyle, więc wystarcza TIMEOUT_FACTOR razy tyle,
+//  - bez niego `earlier_rtt` to największe RTT wcześniejszych skoków, do
+//    którego dochodzi HOP_MARGIN_MS na każdy z `hops_since_reply` skoków od
+//    ostatniego, który odpowiedział,
+//  - bez żadnej odpowiedzi czekamy do górnej granicy.
+// Milczące routery są więc porzucane po kilku RTT zamiast po sekundzie.
+double probeTimeout(double earlier_rtt, int hops_since_reply, double later_rtt) {
+    if (!is_adaptive)
+        return TIMEOUT_MS;
+    double timeout;
+    if (later_rtt > 0)
+        timeout = TIMEOUT_FACTOR * later_rtt;
+    else if (earlier_rtt > 0)
+        timeout = TIMEOUT_FACTOR * earlier_rtt + HOP_MARGIN_MS * hops_since_reply;
+    else
+        return timeout_ceiling_ms;
+    if (timeout < timeout_floor_ms)
+        return timeout_floor_ms;
+    if (timeout > timeout_ceiling_ms)
+        return timeout_ceiling_ms;
+    return timeout;
+}
+
+double receivePacket(int sockfd, char* responseIpAddr, int* response_type, struct timespec *start, int seqNum, double timeout_ms) {
     fd_set read_fds;
     FD_ZERO(&read_fds);
     FD_SET(sockfd, &read_fds);
 
     struct timeval timeout;
-    timeout.tv_sec = 1; 
-    timeout.tv_usec = 0;
+    timeout.tv_sec = (int)timeout_ms / 1000;
+    timeout.tv_usec = (long)(timeout_ms * 1000) % 1000000;
     int select_result = 1;
     while (select_result > 0) {
         select_result = select(sockfd + 1, &read_fds, NULL, NULL, &timeout);
@@ -124,8 +373,8 @@ double receivePacket(int sockfd, char* responseIpAddr, int* response_type, struc
 
         unsigned char buffer[IP_MAXPACKET];
         struct sockaddr_in sender;
-        socklen_t sender_len = sizeof(sender);
-        ssize_t packet_len = recvfrom(sockfd, buffer, IP_MAXPACKET, MSG_DONTWAIT, (struct sockaddr *)&sender, &sender_len);
+        struct timespec end;
+        ssize_t packet_len = receiveWithTimestamp(sockfd, buffer, &sender, &end);
 
         if (packet_len < 0) {
             fprintf(stderr, "recvfrom error: %s\n", strerror(errno));
@@ -143,9 +392,6 @@ double receivePacket(int sockfd, char* responseIpAddr, int* response_type, struc
         }
         int packetSeqNum = icmp_header->un.echo.sequence;
         if (icmp_header->un.echo.id == (getpid() & 0xFFFF) && packetSeqNum == seqNum) {
-            struct timespec end;
-            clock_gettime(CLOCK_MONOTONIC, &end);
-
             double elapsed_ms = (end.tv_sec - start->tv_sec) * 1000.0 + (end.tv_nsec - start->tv_nsec) / 1000000.0;
             return elapsed_ms;
         }
@@ -153,9 +399,1275 @@ double receivePacket(int sockfd, char* responseIpAddr, int* response_type, struc
     return -1;
 }
 
+double elapsedMs(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1000.0 + (end->tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+void printHop(int ttl, Probe probes[]) {
+    printf("%d. ", ttl);
+    bool are_all_on_time = true;
+    bool any_response = false;
+    double elapsed_time[PROBES_PER_TTL];
+    for (int i = 0; i < PROBES_PER_TTL; i++) {
+        elapsed_time[i] = probes[i].rtt;
+        bool is_new = true;
+        for (int j = 0; j < i; j++)
+            is_new &= probes[j].rtt == -1 || strcmp(probes[i].responder, probes[j].responder) != 0;
+        if (is_new && probes[i].rtt != -1)
+            printf("%s ", probes[i].responder);
+        are_all_on_time &= probes[i].rtt != -1;
+        any_response |= probes[i].rtt != -1;
+    }
+    if (!any_response)
+        printf("*\n");
+    else if (are_all_on_time)
+        printf("%dms\n", round_average(elapsed_time, PROBES_PER_TTL));
+    else
+        printf("???\n");
+}
+
+// Wyciąga numer sekwencyjny i typ z odpowiedzi na nasze echo oraz adres, do
+// którego szła sonda. Własne żądania echo, które gniazdo surowe też widzi
+// (np. na lo), są pomijane.
+bool parseReply(unsigned char *buffer, ssize_t packet_len, const struct in_addr *sender,
+                int *seqNum, int *response_type, struct in_addr *destination) {
+    struct iphdr *ip_header = (struct iphdr *)buffer;
+    if (packet_len < (ssize_t)sizeof(struct iphdr) || packet_len < 4 * ip_header->ihl + 8)
+        return false;
+    struct icmphdr *icmp_header = (struct icmphdr *)(buffer + 4 * ip_header->ihl);
+    *response_type = icmp_header->type;
+    if (*response_type == ICMP_TIME_EXCEEDED || *response_type == ICMP_DEST_UNREACH) {
+        ip_header = (struct iphdr *)((u_int8_t *)icmp_header + 8);
+        if ((u_int8_t *)ip_header + sizeof(struct iphdr) > buffer + packet_len)
+            return false;
+        u_int8_t *inner = (u_int8_t *)ip_header + 4 * ip_header->ihl;
+        if (inner + 8 > buffer + packet_len)
+            return false;
+        icmp_header = (struct icmphdr *)inner;
+        if (icmp_header->type != ICMP_ECHO)
+            return false;
+        destination->s_addr = ip_header->daddr;
+    } else if (*response_type == ICMP_ECHOREPLY) {
+        *destination = *sender;
+    } else {
+        return false;
+    }
+    if (icmp_header->un.echo.id != (getpid() & 0xFFFF))
+        return false;
+    *seqNum = icmp_header->un.echo.sequence;
+    return true;
+}
+
+// Znaczniki czasu wysłania numerowane są kolejno od zera (jak klucze
+// SOF_TIMESTAMPING_OPT_ID), więc klucz wskazuje sondę w `tx_probes`. Jeśli
+// odpowiedź przyszła przed znacznikiem, RTT jest przeliczane.
+void receiveTxTimestamps(Tracer *tracer) {
+    u_int32_t key;
+    struct timespec stamp;
+    while (tracer->backend->receive_tx_timestamp(tracer->backend->context, &key, &stamp)) {
+        Probe *probe = tracer->tx_probes[key % TX_KEYS];
+        if (probe == NULL || probe->tx_key != key)
+            continue;
+        tracer->tx_probes[key % TX_KEYS] = NULL;
+        probe->sent_at = stamp;
+        if (probe->rtt != -1)
+            probe->rtt = elapsedMs(&probe->sent_at, &probe->received_at);
+    }
+}
+
+// Odbiera wszystkie oczekujące odpowiedzi i przypisuje je sondom po numerze
+// sekwencyjnym. Adres celu z odpowiedzi musi zgadzać się z celem slotu, żeby
+// spóźniona odpowiedź dla poprzedniego celu nie trafiła do nowego.
+void receiveReplies(Tracer *tracer) {
+    receiveTxTimestamps(tracer);
+    while (1) {
+        unsigned char buffer[IP_MAXPACKET];
+        struct sockaddr_in sender;
+        struct timespec received_at;
+        ssize_t packet_len = tracer->backend->receive(tracer->backend->context, buffer, &sender, &received_at);
+        if (packet_len < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                fprintf(stderr, "recvfrom error: %s\n", strerror(errno));
+            return;
+        }
+
+        int seqNum, response_type;
+        struct in_addr destination;
+        if (!parseReply(buffer, packet_len, &sender.sin_addr, &seqNum, &response_type, &destination))
+            continue;
+        int slot = seqNum >> SLOT_SHIFT;
+        int ttl = (seqNum & ((1 << SLOT_SHIFT) - 1)) / PROBES_PER_TTL;
+        if (slot >= tracer->slots || ttl < 1 || ttl > MAX_TTL)
+            continue;
+        Trace *trace = &tracer->traces[slot];
+        if (!trace->is_active || trace->recipient.sin_addr.s_addr != destination.s_addr)
+            continue;
+        // Sonda po terminie wciąż przyjmuje odpowiedź, dopóki jej skok nie
+        // został wypisany.
+        Probe *probe = &trace->probes[ttl][(seqNum & ((1 << SLOT_SHIFT) - 1)) % PROBES_PER_TTL];
+        if (probe->rtt != -1 || ttl <= trace->printed_ttl || ttl >= trace->next_ttl)
+            continue;
+        probe->is_pending = false;
+        probe->received_at = received_at;
+        probe->rtt = elapsedMs(&probe->sent_at, &received_at);
+        if (probe->rtt > trace->hop_rtt[ttl])
+            trace->hop_rtt[ttl] = probe->rtt;
+        probe->response_type = response_type;
+        inet_ntop(AF_INET, &sender.sin_addr, probe->responder, INET_ADDRSTRLEN);
+        if (response_type != ICMP_TIME_EXCEEDED && ttl < trace->reached_ttl)
+            trace->reached_ttl = ttl;
+    }
+}
+
+// Przygotowuje trasę do `target`, w tym adres i szablon pakietu, z którego
+// powstają wszystkie jej sondy.
+void initTrace(Trace *trace, const char *target) {
+    memset(trace, 0, sizeof(*trace));
+    trace->is_active = true;
+    snprintf(trace->target, sizeof(trace->target), "%s", target);
+    trace->recipient.sin_family = AF_INET;
+    inet_pton(AF_INET, target, &trace->recipient.sin_addr);
+    trace->template.type = ICMP_ECHO;
+    trace->template.un.echo.id = getpid() & 0xFFFF;
+    trace->template.checksum = compute_icmp_checksum(&trace->template, sizeof(trace->template));
+    trace->next_ttl = 1;
+    trace->reached_ttl = MAX_TTL;
+    trace->ttl_mask = ALL_TTLS;
+    trace->cached = -1;
+}
+
+void initTransmitQueue(TransmitQueue *queue) {
+    memset(queue, 0, sizeof(*queue));
+    for (int i = 0; i < SEND_BATCH; i++) {
+        queue->iov[i].iov_base = &queue->headers[i];
+        queue->iov[i].iov_len = sizeof(queue->headers[i]);
+        struct msghdr *msg = &queue->msgs[i].msg_hdr;
+        msg->msg_namelen = sizeof(struct sockaddr_in);
+        msg->msg_iov = &queue->iov[i];
+        msg->msg_iovlen = 1;
+        msg->msg_control = queue->control[i].buffer;
+        msg->msg_controllen = sizeof(queue->control[i].buffer);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+        cmsg->cmsg_level = IPPROTO_IP;
+        cmsg->cmsg_type = IP_TTL;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    }
+}
+
+// Wysyła zakolejkowane sondy. Czas wysłania jest wspólny dla całej paczki.
+// Sondy, których jądro nie przyjęło, od razu liczą się jako zgubione.
+void flushProbes(Tracer *tracer) {
+    TransmitQueue *queue = &tracer->queue;
+    struct timespec now, wall;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    clock_gettime(CLOCK_REALTIME, &wall);
+    int sent = 0;
+    while (sent < queue->count) {
+        int result = tracer->backend->send(tracer->backend->context, queue->msgs + sent, queue->count - sent);
+        if (result < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("sendmmsg failed");
+            break;
+        }
+        sent += result;
+    }
+    // Do czasu nadejścia znacznika jądra sonda ma czas sprzed sendmmsg.
+    for (int i = 0; i < queue->count; i++) {
+        Probe *probe = queue->probes[i];
+        probe->sent = now;
+        probe->sent_at = wall;
+        probe->is_pending = i < sent;
+        if (probe->is_pending) {
+            probe->tx_key = tracer->next_tx_key++;
+            tracer->tx_probes[probe->tx_key % TX_KEYS] = probe;
+        }
+    }
+    queue->count = 0;
+}
+
+// Kolejkuje sondy dla jednego TTL. Nagłówek powstaje z szablonu trasy, a suma
+// kontrolna jest poprawiana tylko o zmieniony numer sekwencyjny.
+void sendProbes(Tracer *tracer, int slot, int ttl) {
+    Trace *trace = &tracer->traces[slot];
+    TransmitQueue *queue = &tracer->queue;
+    for (int i = 0; i < PROBES_PER_TTL; i++) {
+        int n = queue->count++;
+        u_int16_t seqNum = slot << SLOT_SHIFT | (ttl * PROBES_PER_TTL + i);
+        struct icmphdr *header = &queue->headers[n];
+        *header = trace->template;
+        header->un.echo.sequence = seqNum;
+        header->checksum = update_icmp_checksum(trace->template.checksum, trace->template.un.echo.sequence, seqNum);
+        queue->msgs[n].msg_hdr.msg_name = &trace->recipient;
+        memcpy(CMSG_DATA(CMSG_FIRSTHDR(&queue->msgs[n].msg_hdr)), &ttl, sizeof(ttl));
+
+        Probe *probe = &trace->probes[ttl][i];
+        probe->rtt = -1;
+        queue->probes[n] = probe;
+        trace->probes_sent++;
+        if (queue->count == SEND_BATCH) {
+            flushProbes(tracer);
+            // Odpowiedzi na wcześniejsze sondy mogłyby przepełnić bufor gniazda.
+            receiveReplies(tracer);
+        }
+    }
+}
+
+// Wypełnia `timeouts` czasem oczekiwania dla każdego TTL trasy.
+void hopTimeouts(const Trace *trace, double timeouts[]) {
+    double later[MAX_TTL + 2];
+    later[MAX_TTL + 1] = 0;
+    for (int ttl = MAX_TTL; ttl >= 1; ttl--)
+        later[ttl] = fmax(later[ttl + 1], trace->hop_rtt[ttl]);
+    double earlier = 0;
+    int last_reply = 0;
+    for (int ttl = 1; ttl <= MAX_TTL; ttl++) {
+        timeouts[ttl] = probeTimeout(earlier, ttl - last_reply, later[ttl]);
+        if (trace->hop_rtt[ttl] > 0) {
+            earlier = fmax(earlier, trace->hop_rtt[ttl]);
+            last_reply = ttl;
+        }
+    }
+}
+
+// Zwraca, czy wszystkie sondy danego TTL są rozstrzygnięte, oznaczając te
+// po terminie jako zgubione.
+bool isHopDone(Trace *trace, int ttl, double timeout, const struct timespec *now) {
+    bool is_done = true;
+    for (int i = 0; i < PROBES_PER_TTL; i++) {
+        Probe *probe = &trace->probes[ttl][i];
+        if (probe->is_pending && elapsedMs(&probe->sent, now) >= timeout)
+            probe->is_pending = false;
+        is_done &= !probe->is_pending;
+    }
+    return is_done;
+}
+
+// Jedna linia JSON na trasę: dla każdego skoku adres i RTT każdej sondy,
+// null dla sond bez odpowiedzi.
+bool isReached(Trace *trace) {
+    bool is_reached = false;
+    for (int i = 0; i < PROBES_PER_TTL; i++) {
+        Probe *probe = &trace->probes[trace->reached_ttl][i];
+        is_reached |= probe->rtt != -1 && probe->response_type == ICMP_ECHOREPLY;
+    }
+    return is_reached;
+}
+
+void printTraceJson(Trace *trace) {
+    bool is_reached = isReached(trace);
+    printf("{\"target\":\"%s\",\"reached\":%s,\"hops\":[", trace->target, is_reached ? "true" : "false");
+    for (int ttl = 1; ttl <= trace->reached_ttl; ttl++) {
+        printf("%s[", ttl > 1 ? "," : "");
+        for (int i = 0; i < PROBES_PER_TTL; i++) {
+            Probe *probe = &trace->probes[ttl][i];
+            if (i > 0)
+                printf(",");
+            if (probe->rtt == -1)
+                printf("null");
+            else
+                printf("{\"addr\":\"%s\",\"rtt\":%.3f}", probe->responder, probe->rtt);
+        }
+        printf("]");
+    }
+    printf("]}\n");
+    fflush(stdout);
+}
+
+int rttClass(double rtt) {
+    return (int)log2(1 + rtt);
+}
+
+int compareEntries(const void *a, const void *b) {
+    u_int32_t x = ntohl(((const PathEntry *)a)->target.s_addr);
+    u_int32_t y = ntohl(((const PathEntry *)b)->target.s_addr);
+    return (x > y) - (x < y);
+}
+
+PathEntry *addEntry(PathCache *cache) {
+    if (cache->count == cache->capacity) {
+        cache->capacity = cache->capacity ? 2 * cache->capacity : 1024;
+        cache->entries = realloc(cache->entries, cache->capacity * sizeof(PathEntry));
+        if (cache->entries == NULL) {
+            perror("Allocation failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    PathEntry *entry = &cache->entries[cache->count++];
+    memset(entry, 0, sizeof(*entry));
+    return entry;
+}
+
+// Plik ma jedną linię na cel: "cel liczba_uruchomień reached|unreached skok...",
+// gdzie skok to "adres/klasa_RTT" albo "*" dla cichego skoku. Brak pliku
+// oznacza pustą pamięć.
+void loadCache(PathCache *cache, char *path) {
+    memset(cache, 0, sizeof(*cache));
+    cache->path = path;
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return;
+    char line[1024];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char *target = strtok(line, " \n");
+        char *runs = strtok(NULL, " \n");
+        char *state = strtok(NULL, " \n");
+        if (target == NULL || runs == NULL || state == NULL)
+            continue;
+        PathEntry *entry = addEntry(cache);
+        if (inet_pton(AF_INET, target, &entry->target) != 1) {
+            cache->count--;
+            continue;
+        }
+        entry->runs = atoi(runs);
+        entry->is_reached = strcmp(state, "reached") == 0;
+        char *hop;
+        while (entry->hops < MAX_TTL && (hop = strtok(NULL, " \n")) != NULL) {
+            int ttl = ++entry->hops;
+            char *slash = strchr(hop, '/');
+            entry->rtt_class[ttl] = -1;
+            if (slash == NULL)
+                continue;
+            *slash = '\0';
+            inet_pton(AF_INET, hop, &entry->responders[ttl]);
+            entry->rtt_class[ttl] = atoi(slash + 1);
+        }
+    }
+    fclose(file);
+    qsort(cache->entries, cache->count, sizeof(PathEntry), compareEntries);
+    cache->sorted = cache->count;
+}
+
+// Zapisuje pamięć do pliku tymczasowego i podmienia go, żeby przerwany zapis
+// nie zostawił uciętego pliku.
+void saveCache(PathCache *cache) {
+    char temporary[4096];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", cache->path);
+    FILE *file = fopen(temporary, "w");
+    if (file == NULL) {
+        perror("Error writing path cache");
+        return;
+    }
+    qsort(cache->entries, cache->count, sizeof(PathEntry), compareEntries);
+    for (int i = 0; i < cache->count; i++) {
+        PathEntry *entry = &cache->entries[i];
+        if (i > 0 && entry->target.s_addr == entry[-1].target.s_addr)
+            continue;
+        char address[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &entry->target, address, sizeof(address));
+        fprintf(file, "%s %d %s", address, entry->runs, entry->is_reached ? "reached" : "unreached");
+        for (int ttl = 1; ttl <= entry->hops; ttl++) {
+            if (entry->responders[ttl].s_addr == INADDR_ANY) {
+                fprintf(file, " *");
+                continue;
+            }
+            inet_ntop(AF_INET, &entry->responders[ttl], address, sizeof(address));
+            fprintf(file, " %s/%d", address, entry->rtt_class[ttl]);
+        }
+        fprintf(file, "\n");
+    }
+    if (fclose(file) != 0 || rename(temporary, cache->path) != 0)
+        perror("Error writing path cache");
+}
+
+int findEntry(PathCache *cache, struct in_addr target) {
+    PathEntry key = {.target = target};
+    PathEntry *entry = bsearch(&key, cache->entries, cache->sorted, sizeof(PathEntry), compareEntries);
+    return entry == NULL ? -1 : entry - cache->entries;
+}
+
+// Adres, który odpowiedział na TTL, i klasa najmniejszego RTT. Zwraca false,
+// jeśli żadna sonda nie dostała odpowiedzi.
+bool hopResponse(Trace *trace, int ttl, struct in_addr *responder, int *rtt_class) {
+    double best = -1;
+    for (int i = 0; i < PROBES_PER_TTL; i++) {
+        Probe *probe = &trace->probes[ttl][i];
+        if (probe->rtt == -1 || (best != -1 && probe->rtt >= best))
+            continue;
+        best = probe->rtt;
+        inet_pton(AF_INET, probe->responder, responder);
+    }
+    if (best == -1)
+        return false;
+    *rtt_class = rttClass(best);
+    return true;
+}
+
+// Cel ze znaną, osiągniętą trasą jest najpierw sondowany tylko na TTL celu i co
+// SAMPLE_STRIDE-tym skoku. Przesunięcie zmienia się z każdym uruchomieniem,
+// więc po kilku z nich sprawdzone są wszystkie skoki.
+void startCachedTrace(PathCache *cache, Trace *trace) {
+    trace->cached = findEntry(cache, trace->recipient.sin_addr);
+    if (trace->cached == -1)
+        return;
+    PathEntry *entry = &cache->entries[trace->cached];
+    if (!entry->is_reached) {
+        trace->retrace_from = 1;
+        return;
+    }
+    trace->ttl_mask = 1U << entry->hops;
+    for (int ttl = 1; ttl < entry->hops; ttl++)
+        if ((ttl + entry->runs) % SAMPLE_STRIDE == 0)
+            trace->ttl_mask |= 1U << ttl;
+}
+
+// Porównuje próbki z zapamiętaną trasą. Zwraca pierwszy zmieniony skok:
+// próbkę z innym nadawcą albo klasą RTT różną o więcej niż jeden (różnica o
+// jeden to zwykle szum na granicy klas), a jeśli cel nie odpowiedział na
+// swoim TTL, skok tuż za ostatnim potwierdzonym. Zwraca 0, gdy trasa się nie
+// zmieniła. W `last_ok` zostaje ostatnia potwierdzona próbka przed zmianą.
+// Cichy skok nie niesie informacji.
+int sampleChange(Trace *trace, PathEntry *entry, int *last_ok) {
+    *last_ok = 0;
+    for (int ttl = 1; ttl <= entry->hops; ttl++) {
+        if (!(trace->ttl_mask & 1U << ttl))
+            continue;
+        struct in_addr responder;
+        int rtt_class;
+        if (!hopResponse(trace, ttl, &responder, &rtt_class)) {
+            if (ttl == entry->hops)
+                return *last_ok + 1;
+            continue;
+        }
+        if (responder.s_addr != entry->responders[ttl].s_addr || abs(rtt_class - entry->rtt_class[ttl]) > 1)
+            return ttl;
+        *last_ok = ttl;
+    }
+    return isReached(trace) && trace->reached_ttl == entry->hops ? 0 : *last_ok + 1;
+}
+
+// Śledzi trasę od nowa od skoku `from`. Niesprawdzone próbkami skoki od
+// `confirm_from` do `from` są sondowane w tej samej serii, bo zmiana mogła
+// nastąpić już na nich. Ponad rozstrzygnięte skoki w drodze jest najwyżej
+// `window` TTL.
+void restartTrace(Trace *trace, int confirm_from, int from, int window) {
+    u_int32_t sampled = trace->ttl_mask;
+    for (int ttl = from; ttl <= MAX_TTL; ttl++) {
+        memset(trace->probes[ttl], 0, sizeof(trace->probes[ttl]));
+        trace->hop_rtt[ttl] = 0;
+    }
+    trace->ttl_mask = ALL_TTLS & ~((1U << from) - 1);
+    for (int ttl = confirm_from; ttl < from; ttl++)
+        if (!(sampled & 1U << ttl))
+            trace->ttl_mask |= 1U << ttl;
+    trace->next_ttl = confirm_from;
+    trace->printed_ttl = confirm_from - 1;
+    trace->reached_ttl = MAX_TTL;
+    trace->retrace_from = from;
+    trace->window = window;
+}
+
+void printAddress(struct in_addr address) {
+    char text[INET_ADDRSTRLEN];
+    if (address.s_addr == INADDR_ANY) {
+        printf("null");
+        return;
+    }
+    inet_ntop(AF_INET, &address, text, sizeof(text));
+    printf("\"%s\"", text);
+}
+
+// Zdarzenie dla każdego skoku, którego nadawca zmienił się względem `old`, a
+// potem jedna linia z aktualną trasą, liczbą wysłanych sond, pierwszym
+// zmienionym skokiem i TTL, od którego trasa była śledzona od nowa (null,
+// jeśli nie).
+void printCachedTrace(Trace *trace, PathEntry *old, PathEntry *entry) {
+    int changed_from = 0;
+    for (int ttl = 1; old != NULL && ttl <= MAX_TTL; ttl++) {
+        struct in_addr was = ttl <= old->hops ? old->responders[ttl] : (struct in_addr){INADDR_ANY};
+        struct in_addr is = ttl <= entry->hops ? entry->responders[ttl] : (struct in_addr){INADDR_ANY};
+        if (was.s_addr == is.s_addr)
+            continue;
+        if (changed_from == 0)
+            changed_from = ttl;
+        printf("{\"event\":\"path_change\",\"target\":\"%s\",\"ttl\":%d,\"old\":", trace->target, ttl);
+        printAddress(was);
+        printf(",\"new\":");
+        printAddress(is);
+        printf("}\n");
+    }
+    printf("{\"target\":\"%s\",\"reached\":%s,\"changed_from\":", trace->target, entry->is_reached ? "true" : "false");
+    if (changed_from)
+        printf("%d", changed_from);
+    else
+        printf("null");
+    printf(",\"retraced_from\":");
+    if (trace->retrace_from)
+        printf("%d", trace->retrace_from);
+    else
+        printf("null");
+    printf(",\"probes\":%d,\"path\":[", trace->probes_sent);
+    for (int ttl = 1; ttl <= entry->hops; ttl++) {
+        if (ttl > 1)
+            printf(",");
+        printAddress(entry->responders[ttl]);
+    }
+    printf("]}\n");
+    fflush(stdout);
+}
+
+// Kończy trasę w trybie z pamięcią tras. Po fazie próbkowania albo
+// potwierdza zapamiętaną trasę, albo zaczyna śledzenie od miejsca zmiany i
+// zwraca true. Po pełnym śledzeniu zapisuje nową trasę, biorąc skoki, które
+// nie były ponownie sondowane, z pamięci.
+bool finishCachedTrace(PathCache *cache, Trace *trace) {
+    if (trace->cached != -1 && trace->retrace_from == 0) {
+        PathEntry *entry = &cache->entries[trace->cached];
+        int last_ok;
+        int from = sampleChange(trace, entry, &last_ok);
+        if (from > 0) {
+            restartTrace(trace, last_ok + 1, from, entry->hops + RETRACE_MARGIN - last_ok);
+            return true;
+        }
+        entry->runs++;
+        printCachedTrace(trace, NULL, entry);
+        return false;
+    }
+
+    PathEntry old;
+    bool has_old = trace->cached != -1;
+    if (has_old)
+        old = cache->entries[trace->cached];
+    PathEntry *entry = has_old ? &cache->entries[trace->cached] : addEntry(cache);
+    entry->target = trace->recipient.sin_addr;
+    entry->runs++;
+    entry->is_reached = isReached(trace);
+    entry->hops = trace->reached_ttl;
+    for (int ttl = 1; ttl <= trace->reached_ttl; ttl++)
+        if (trace->ttl_mask & 1U << ttl && !hopResponse(trace, ttl, &entry->responders[ttl], &entry->rtt_class[ttl])) {
+            entry->responders[ttl].s_addr = INADDR_ANY;
+            entry->rtt_class[ttl] = -1;
+        }
+    while (!entry->is_reached && entry->hops > 0 && entry->responders[entry->hops].s_addr == INADDR_ANY)
+        entry->hops--;
+    printCachedTrace(trace, has_old ? &old : NULL, entry);
+    return false;
+}
+
+// Wypisuje tekst z wejścia jako napis JSON. Bajty sterujące i spoza ASCII
+// są zapisywane jako \u00XX, więc wynik jest poprawny nawet dla śmieci.
+void printJsonString(const char *text) {
+    putchar('"');
+    for (const unsigned char *c = (const unsigned char *)text; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\')
+            printf("\\%c", *c);
+        else if (*c < 0x20 || *c >= 0x7f)
+            printf("\\u%04x", *c);
+        else
+            putchar(*c);
+    }
+    putchar('"');
+}
+
+// Zajmuje wolny slot kolejnym celem z wejścia. Zwraca false na końcu wejścia.
+bool startNextTrace(Tracer *tracer, int slot) {
+    char line[256];
+    while (fgets(line, sizeof(line), tracer->targets) != NULL) {
+        line[strcspn(line, " \t\r\n#")] = '\0';
+        if (line[0] == '\0')
+            continue;
+        // Plik z celami nie jest zaufany: isValidIPAddress przepuszcza zera
+        // wiodące o dowolnej długości.
+        struct in_addr addr;
+        if (inet_pton(AF_INET, line, &addr) != 1) {
+            printf("{\"target\":");
+            printJsonString(line);
+            printf(",\"error\":\"invalid address\"}\n");
+            continue;
+        }
+        initTrace(&tracer->traces[slot], line);
+        if (tracer->cache != NULL)
+            startCachedTrace(tracer->cache, &tracer->traces[slot]);
+        tracer->active++;
+        return true;
+    }
+    tracer->targets = NULL;
+    return false;
+}
+
+// Uzupełnia żetony globalnego limitu sond. Zwraca, za ile milisekund będzie
+// ich dość na kolejny TTL.
+double refillTokens(Tracer *tracer, const struct timespec *now) {
+    if (tracer->rate <= 0)
+        return 0;
+    tracer->tokens += elapsedMs(&tracer->last_refill, now) * tracer->rate / 1000.0;
+    if (tracer->tokens > tracer->rate / 10 + PROBES_PER_TTL)
+        tracer->tokens = tracer->rate / 10 + PROBES_PER_TTL;
+    tracer->last_refill = *now;
+    if (tracer->tokens >= PROBES_PER_TTL)
+        return 0;
+    return (PROBES_PER_TTL - tracer->tokens) * 1000.0 / tracer->rate;
+}
+
+// Wysyła sondy dla `window` kolejnych TTL każdej trasy, na ile pozwala limit.
+// Sloty są obsługiwane od `first`, żeby przy limicie żaden cel nie czekał
+// stale na pozostałe.
+double sendWindow(Tracer *tracer, int first, const struct timespec *now) {
+    double wait_ms = refillTokens(tracer, now);
+    for (int n = 0; n < tracer->slots; n++) {
+        int slot = (first + n) % tracer->slots;
+        Trace *trace = &tracer->traces[slot];
+        int window = trace->window > 0 && trace->window < tracer->window ? trace->window : tracer->window;
+        while (trace->is_active && trace->next_ttl <= trace->reached_ttl &&
+               trace->next_ttl <= trace->printed_ttl + window) {
+            if (!(trace->ttl_mask & 1U << trace->next_ttl)) {
+                trace->next_ttl++;
+                continue;
+            }
+            if (tracer->rate > 0 && (wait_ms = refillTokens(tracer, now)) > 0) {
+                flushProbes(tracer);
+                return wait_ms;
+            }
+            sendProbes(tracer, slot, trace->next_ttl++);
+            tracer->tokens -= PROBES_PER_TTL;
+        }
+    }
+    flushProbes(tracer);
+    return TIMEOUT_MS;
+}
+
+// Rozstrzyga kolejne skoki trasy. W trybie jednego celu wypisuje je na
+// bieżąco, w trybie wsadowym wypisuje całą trasę i zwalnia slot.
+void settleTrace(Tracer *tracer, Trace *trace, const struct timespec *now) {
+    double timeouts[MAX_TTL + 1];
+    hopTimeouts(trace, timeouts);
+    while (trace->printed_ttl < trace->reached_ttl && trace->printed_ttl < trace->next_ttl - 1 &&
+           isHopDone(trace, trace->printed_ttl + 1, timeouts[trace->printed_ttl + 1], now)) {
+        trace->printed_ttl++;
+        if (!tracer->is_batch && !tracer->is_monitor)
+            printHop(trace->printed_ttl, trace->probes[trace->printed_ttl]);
+    }
+    if (trace->printed_ttl < trace->reached_ttl)
+        return;
+    if (tracer->cache != NULL && finishCachedTrace(tracer->cache, trace))
+        return;
+    trace->is_active = false;
+    tracer->active--;
+    if (tracer->is_batch && tracer->cache == NULL)
+        printTraceJson(trace);
+}
+
+// Przy wielu sondach w drodze domyślny bufor gniazda surowego mieści za mało
+// odpowiedzi.
+void growReceiveBuffer(int sockfd) {
+    int size = RECEIVE_BUFFER;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0 &&
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0)
+        perror("setsockopt SO_RCVBUF failed");
+}
+
+// Tryb równoległy: sondy dla `window` kolejnych TTL każdej trasy są w drodze
+// jednocześnie, a skoki rozstrzygane po kolei. Przy oknie równym MAX_TTL
+// cała trasa trwa około RTT plus czas oczekiwania (hopTimeouts).
+void runTracer(Tracer *tracer) {
+    initTransmitQueue(&tracer->queue);
+    clock_gettime(CLOCK_MONOTONIC, &tracer->last_refill);
+    int first = 0;
+    while (tracer->active > 0 || tracer->targets != NULL) {
+        for (int slot = 0; slot < tracer->slots && tracer->targets != NULL; slot++)
+            if (!tracer->traces[slot].is_active)
+                startNextTrace(tracer, slot);
+        if (tracer->active == 0)
+            break;
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double wait_ms = sendWindow(tracer, first, &now);
+        first = (first + 1) % tracer->slots;
+        for (int slot = 0; slot < tracer->slots; slot++) {
+            Trace *trace = &tracer->traces[slot];
+            if (!trace->is_active)
+                continue;
+            double timeouts[MAX_TTL + 1];
+            hopTimeouts(trace, timeouts);
+            for (int ttl = trace->printed_ttl + 1; ttl < trace->next_ttl; ttl++)
+                for (int i = 0; i < PROBES_PER_TTL; i++)
+                    if (trace->probes[ttl][i].is_pending) {
+                        double left = timeouts[ttl] - elapsedMs(&trace->probes[ttl][i].sent, &now);
+                        if (left < wait_ms)
+                            wait_ms = left;
+                    }
+        }
+        if (wait_ms < 0)
+            wait_ms = 0;
+
+        int select_result = tracer->backend->wait(tracer->backend->context, wait_ms);
+        if (select_result == -1 && errno != EINTR) {
+            perror("select failed");
+            return;
+        }
+        if (select_result > 0)
+            receiveReplies(tracer);
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        for (int slot = 0; slot < tracer->slots; slot++)
+            if (tracer->traces[slot].is_active)
+                settleTrace(tracer, &tracer->traces[slot], &now);
+    }
+}
+
+int rawSend(void *context, struct mmsghdr *msgs, int count) {
+    return sendmmsg(*(int *)context, msgs, count, 0);
+}
+
+ssize_t rawReceive(void *context, unsigned char *buffer, struct sockaddr_in *sender, struct timespec *received_at) {
+    return receiveWithTimestamp(*(int *)context, buffer, sender, received_at);
+}
+
+// Czyta znacznik czasu wysłania z kolejki błędów gniazda.
+bool rawReceiveTxTimestamp(void *context, u_int32_t *key, struct timespec *sent_at) {
+    while (1) {
+        // Poza SCM_TIMESTAMPING i IP_RECVERR przychodzi tu też SCM_TIMESTAMPNS.
+        union {
+            char buffer[512];
+            struct cmsghdr align;
+        } control;
+        struct msghdr msg = {.msg_control = control.buffer, .msg_controllen = sizeof(control.buffer)};
+        if (recvmsg(*(int *)context, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            return false;
+
+        struct timespec *stamp = NULL;
+        struct sock_extended_err *error = NULL;
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING)
+                stamp = &((struct scm_timestamping *)CMSG_DATA(cmsg))->ts[0];
+            else if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVERR)
+                error = (struct sock_extended_err *)CMSG_DATA(cmsg);
+        }
+        if (stamp != NULL && error != NULL && error->ee_origin == SO_EE_ORIGIN_TIMESTAMPING) {
+            *key = error->ee_data;
+            *sent_at = *stamp;
+            return true;
+        }
+    }
+}
+
+int rawWait(void *context, double timeout_ms) {
+    int sockfd = *(int *)context;
+    fd_set read_fds;
+    FD_ZERO(&read_fds);
+    FD_SET(sockfd, &read_fds);
+    struct timeval timeout;
+    timeout.tv_sec = (int)timeout_ms / 1000;
+    timeout.tv_usec = (long)(timeout_ms * 1000) % 1000000;
+    return select(sockfd + 1, &read_fds, NULL, NULL, &timeout);
+}
+
+void rawClose(void *context) {
+    close(*(int *)context);
+    free(context);
+}
+
+bool openRawBackend(Backend *backend) {
+    int sockfd = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
+    if (sockfd < 0) {
+        perror("socket creation failed");
+        return false;
+    }
+    growReceiveBuffer(sockfd);
+    attachFilter(sockfd);
+    enableTimestamps(sockfd, true);
+    int *context = malloc(sizeof(int));
+    *context = sockfd;
+    *backend = (Backend){.context = context, .send = rawSend, .receive = rawReceive,
+                         .receive_tx_timestamp = rawReceiveTxTimestamp, .wait = rawWait, .close = rawClose};
+    return true;
+}
+
+// Węzeł symulowanej ścieżki. `delay_ms` to RTT do niego, do którego
+// dochodzi losowy jitter z [0, jitter_ms). Router z `rate` > 0 wysyła
+// najwyżej tyle komunikatów ICMP na sekundę (z małym zapasem), jak Linux z
+// icmp_ratelimit; cichy router nie odpowiada wcale.
+typedef struct SimHop {
+    struct in_addr addr;
+    bool is_silent;
+    double delay_ms;
+    double jitter_ms;
+    double loss;
+    double rate;
+    double tokens;
+    double last_refill_ms;
+} SimHop;
+
+typedef struct SimReply {
+    double deliver_ms;
+    struct timespec received_at;
+    struct sockaddr_in sender;
+    int length;
+    unsigned char packet[SIM_PACKET_SIZE];
+} SimReply;
+
+// Symulowana sieć: ta sama ścieżka routerów prowadzi do każdego celu, a cel
+// odpowiada na echo, gdy TTL sięga dalej niż ostatni router. Odpowiedzi czekają
+// w kopcu uporządkowanym po czasie doręczenia i płyną w czasie rzeczywistym,
+// więc silnik działa bez zmian. Losowość ma stałe ziarno, żeby przebiegi
+// dawały się powtórzyć.
+typedef struct Simulation {
+    SimHop routers[MAX_TTL + 1];
+    int router_count;
+    SimHop target;
+    SimReply *pending;
+    int pending_count;
+    unsigned seed;
+} Simulation;
+
+double monotonicMs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+double simRandom(Simulation *simulation) {
+    return rand_r(&simulation->seed) / ((double)RAND_MAX + 1.0);
+}
+
+void pushReply(Simulation *simulation, const SimReply *reply) {
+    if (simulation->pending_count == SIM_MAX_PENDING)
+        return;
+    int i = simulation->pending_count++;
+    while (i > 0 && simulation->pending[(i - 1) / 2].deliver_ms > reply->deliver_ms) {
+        simulation->pending[i] = simulation->pending[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    simulation->pending[i] = *reply;
+}
+
+void popReply(Simulation *simulation, SimReply *top) {
+    SimReply *heap = simulation->pending;
+    *top = heap[0];
+    SimReply last = heap[--simulation->pending_count];
+    int i = 0;
+    while (2 * i + 1 < simulation->pending_count) {
+        int child = 2 * i + 1;
+        if (child + 1 < simulation->pending_count && heap[child + 1].deliver_ms < heap[child].deliver_ms)
+            child++;
+        if (last.deliver_ms <= heap[child].deliver_ms)
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+}
+
+bool allowReply(Simulation *simulation, SimHop *hop, double now) {
+    if (hop->is_silent || simRandom(simulation) < hop->loss)
+        return false;
+    if (hop->rate <= 0)
+        return true;
+    double burst = hop->rate / 10 > 1 ? hop->rate / 10 : 1;
+    hop->tokens += (now - hop->last_refill_ms) * hop->rate / 1000;
+    if (hop->tokens > burst)
+        hop->tokens = burst;
+    hop->last_refill_ms = now;
+    if (hop->tokens < 1)
+        return false;
+    hop->tokens--;
+    return true;
+}
+
+// Buduje odpowiedź tak, jak przyszłaby z sieci: echo reply od celu albo time
+// exceeded od routera, cytujący nagłówek IP i ICMP sondy.
+int simSend(void *context, struct mmsghdr *msgs, int count) {
+    Simulation *simulation = context;
+    double now = monotonicMs();
+    struct timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    for (int n = 0; n < count; n++) {
+        struct msghdr *msg = &msgs[n].msg_hdr;
+        struct icmphdr *probe = msg->msg_iov[0].iov_base;
+        struct sockaddr_in *recipient = msg->msg_name;
+        int ttl;
+        memcpy(&ttl, CMSG_DATA(CMSG_FIRSTHDR(msg)), sizeof(ttl));
+
+        bool is_target = ttl > simulation->router_count;
+        SimHop *hop = is_target ? &simulation->target : &simulation->routers[ttl];
+        if (!allowReply(simulation, hop, now))
+            continue;
+
+        SimReply reply;
+        memset(&reply, 0, sizeof(reply));
+        double delay = hop->delay_ms + simRandom(simulation) * hop->jitter_ms;
+        reply.deliver_ms = now + delay;
+        long nanoseconds = wall.tv_nsec + (long)(delay * 1000000);
+        reply.received_at.tv_sec = wall.tv_sec + nanoseconds / 1000000000;
+        reply.received_at.tv_nsec = nanoseconds % 1000000000;
+        reply.sender.sin_family = AF_INET;
+        reply.sender.sin_addr = is_target ? recipient->sin_addr : hop->addr;
+
+        struct iphdr *ip_header = (struct iphdr *)reply.packet;
+        ip_header->version = 4;
+        ip_header->ihl = 5;
+        ip_header->ttl = 64;
+        ip_header->protocol = IPPROTO_ICMP;
+        ip_header->saddr = reply.sender.sin_addr.s_addr;
+        struct icmphdr *icmp_header = (struct icmphdr *)(reply.packet + sizeof(struct iphdr));
+        if (is_target) {
+            *icmp_header = *probe;
+            icmp_header->type = ICMP_ECHOREPLY;
+            reply.length = sizeof(struct iphdr) + sizeof(struct icmphdr);
+        } else {
+            icmp_header->type = ICMP_TIME_EXCEEDED;
+            struct iphdr *quoted = (struct iphdr *)(icmp_header + 1);
+            quoted->version = 4;
+            quoted->ihl = 5;
+            quoted->ttl = 1;
+            quoted->protocol = IPPROTO_ICMP;
+            quoted->daddr = recipient->sin_addr.s_addr;
+            memcpy(quoted + 1, probe, sizeof(*probe));
+            reply.length = 2 * sizeof(struct iphdr) + 2 * sizeof(struct icmphdr);
+        }
+        pushReply(simulation, &reply);
+    }
+    return count;
+}
+
+ssize_t simReceive(void *context, unsigned char *buffer, struct sockaddr_in *sender, struct timespec *received_at) {
+    Simulation *simulation = context;
+    if (simulation->pending_count == 0 || simulation->pending[0].deliver_ms > monotonicMs()) {
+        errno = EAGAIN;
+        return -1;
+    }
+    SimReply reply;
+    popReply(simulation, &reply);
+    memcpy(buffer, reply.packet, reply.length);
+    *sender = reply.sender;
+    *received_at = reply.received_at;
+    return reply.length;
+}
+
+// Symulacja nie ma znaczników wysłania; zostaje czas sprzed wysłania paczki.
+bool simReceiveTxTimestamp(void *context, u_int32_t *key, struct timespec *sent_at) {
+    (void)context;
+    (void)key;
+    (void)sent_at;
+    return false;
+}
+
+int simWait(void *context, double timeout_ms) {
+    Simulation *simulation = context;
+    double left = simulation->pending_count > 0 ? simulation->pending[0].deliver_ms - monotonicMs() : timeout_ms;
+    bool is_ready = left <= timeout_ms;
+    if (!is_ready)
+        left = timeout_ms;
+    if (left > 0) {
+        struct timespec pause = {.tv_sec = (time_t)(left / 1000), .tv_nsec = (long)(fmod(left, 1000) * 1000000)};
+        nanosleep(&pause, NULL);
+    }
+    return is_ready && simulation->pending_count > 0;
+}
+
+void simClose(void *context) {
+    Simulation *simulation = context;
+    free(simulation->pending);
+    free(simulation);
+}
+
+// Czyta opis ścieżki. Każda linia to
+//   router <adres albo *> <RTT_ms> <jitter_ms> <strata> <limit_ICMP_na_s>
+// w kolejności TTL, oraz jedna linia
+//   target <RTT_ms> <jitter_ms> <strata>
+// Puste linie i komentarze od # są pomijane.
+bool openSimBackend(Backend *backend, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror("Error opening topology");
+        return false;
+    }
+    Simulation *simulation = calloc(1, sizeof(Simulation));
+    simulation->pending = malloc(SIM_MAX_PENDING * sizeof(SimReply));
+    simulation->seed = 1;
+    bool has_target = false;
+    char line[256];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        line[strcspn(line, "#\n")] = '\0';
+        char kind[16], address[INET_ADDRSTRLEN];
+        SimHop hop;
+        memset(&hop, 0, sizeof(hop));
+        if (sscanf(line, "%15s", kind) != 1)
+            continue;
+        bool is_valid;
+        if (strcmp(kind, "router") == 0) {
+            is_valid = simulation->router_count < MAX_TTL &&
+                       sscanf(line, "%*s %15s %lf %lf %lf %lf", address, &hop.delay_ms, &hop.jitter_ms, &hop.loss, &hop.rate) == 5;
+            hop.is_silent = strcmp(address, "*") == 0;
+            if (is_valid && !hop.is_silent)
+                is_valid = inet_pton(AF_INET, address, &hop.addr) == 1;
+            if (is_valid)
+                simulation->routers[++simulation->router_count] = hop;
+        } else {
+            is_valid = strcmp(kind, "target") == 0 &&
+                       sscanf(line, "%*s %lf %lf %lf", &hop.delay_ms, &hop.jitter_ms, &hop.loss) == 3;
+            if (is_valid) {
+                simulation->target = hop;
+                has_target = true;
+            }
+        }
+        if (!is_valid) {
+            printf("Invalid topology line %d.\n", line_number);
+            fclose(file);
+            simClose(simulation);
+            return false;
+        }
+    }
+    fclose(file);
+    if (!has_target) {
+        printf("Topology has no target line.\n");
+        simClose(simulation);
+        return false;
+    }
+    *backend = (Backend){.context = simulation, .send = simSend, .receive = simReceive,
+                         .receive_tx_timestamp = simReceiveTxTimestamp, .wait = simWait, .close = simClose};
+    return true;
+}
+
+bool openBackend(Backend *backend, const char *topology) {
+    return topology != NULL ? openSimBackend(backend, topology) : openRawBackend(backend);
+}
+
+// Tryb wsadowy: cele z pliku albo ze standardowego wejścia ("-"), najwyżej
+// `concurrency` tras naraz na jednym gnieździe. Z `cache_path` znane trasy są
+// tylko sprawdzane i śledzone od nowa od miejsca zmiany.
+int traceBatch(char *path, int window, int concurrency, double rate, char *cache_path, char *topology) {
+    FILE *targets = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (targets == NULL) {
+        perror("Error opening targets");
+        return 1;
+    }
+    Backend backend;
+    if (!openBackend(&backend, topology))
+        return 1;
+    Trace *traces = calloc(concurrency, sizeof(Trace));
+    if (traces == NULL) {
+        perror("Allocation failed");
+        return 1;
+    }
+    PathCache cache;
+    if (cache_path != NULL)
+        loadCache(&cache, cache_path);
+    Tracer tracer = {.backend = &backend, .traces = traces, .slots = concurrency,
+                     .window = window, .targets = targets, .is_batch = true, .rate = rate,
+                     .cache = cache_path != NULL ? &cache : NULL};
+    runTracer(&tracer);
+    if (cache_path != NULL) {
+        saveCache(&cache);
+        free(cache.entries);
+    }
+    free(traces);
+    backend.close(backend.context);
+    if (targets != stdin)
+        fclose(targets);
+    return 0;
+}
+
+void addSample(HopStats *stats, double rtt) {
+    if (stats->received == 0 || rtt < stats->min)
+        stats->min = rtt;
+    if (stats->received == 0 || rtt > stats->max)
+        stats->max = rtt;
+    if (stats->received > 0)
+        stats->jitter += (fabs(rtt - stats->last) - stats->jitter) / 16;
+    stats->last = rtt;
+    stats->sum += rtt;
+    stats->received++;
+
+    int bucket = rtt > HISTOGRAM_BASE_MS ? (int)(8 * log2(rtt / HISTOGRAM_BASE_MS)) : 0;
+    if (bucket >= HISTOGRAM_BUCKETS)
+        bucket = HISTOGRAM_BUCKETS - 1;
+    stats->histogram[bucket]++;
+}
+
+// Środek (geometryczny) przedziału, w którym leży percentyl `fraction`.
+double percentile(const HopStats *stats, double fraction) {
+    long seen = 0;
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        seen += stats->histogram[bucket];
+        if (seen >= fraction * stats->received) {
+            // Środek kubełka może wypaść poza zaobserwowany zakres.
+            double value = HISTOGRAM_BASE_MS * exp2((bucket + 0.5) / 8);
+            return fmin(fmax(value, stats->min), stats->max);
+        }
+    }
+    return stats->max;
+}
+
+void printStats(const char *target, HopStats stats[], int hops, long cycles) {
+    // Na terminalu tabela jest odświeżana w miejscu.
+    if (isatty(STDOUT_FILENO))
+        printf("\033[H\033[J");
+    printf("%s, %ld cycles\n", target, cycles);
+    printf("%3s %-16s %6s %5s %8s %8s %8s %8s %8s %8s %8s %8s\n", "", "Host", "Loss%", "Snt",
+           "Last", "Min", "Avg", "Max", "Jitter", "p50", "p95", "p99");
+    for (int ttl = 1; ttl <= hops; ttl++) {
+        HopStats *hop = &stats[ttl];
+        printf("%2d. %-16s %5.1f%% %5ld", ttl, hop->received > 0 ? hop->responder : "???",
+               hop->sent > 0 ? 100.0 * (hop->sent - hop->received) / hop->sent : 0.0, hop->sent);
+        if (hop->received > 0)
+            printf(" %8.3f %8.3f %8.3f %8.3f %8.3f %8.3f %8.3f %8.3f", hop->last, hop->min,
+                   hop->sum / hop->received, hop->max, hop->jitter, percentile(hop, 0.5),
+                   percentile(hop, 0.95), percentile(hop, 0.99));
+        printf("\n");
+    }
+    if (!isatty(STDOUT_FILENO))
+        printf("\n");
+    fflush(stdout);
+}
+
+volatile sig_atomic_t stop = 0;
+
+void handleSignal(int signal) {
+    (void)signal;
+    stop = 1;
+}
+
+// Tryb ciągły: co `interval_ms` cała trasa jest sondowana równolegle od nowa,
+// a wyniki dopisywane do statystyk skoków. Kończy się po `count` cyklach
+// (0 bez końca) albo po SIGINT.
+int monitor(Backend *backend, char *target, int interval_ms, long count) {
+    struct sigaction action = {.sa_handler = handleSignal};
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    HopStats stats[MAX_TTL + 1];
+    memset(stats, 0, sizeof(stats));
+    int hops = 0;
+    int destination_ttl = 0; // najmniejszy TTL, na którym cel odpowiedział echem
+    Trace trace;
+    Tracer tracer = {.backend = backend, .traces = &trace, .slots = 1, .window = MAX_TTL, .is_monitor = true};
+    long cycles;
+    for (cycles = 0; !stop && (count == 0 || cycles < count); cycles++) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        initTrace(&trace, target);
+        tracer.active = 1;
+        runTracer(&tracer);
+
+        // Gdy giną wszystkie sondy do celu, cel odpowiada dopiero na dalszym
+        // TTL z okna. Taki cykl liczy się jako strata na prawdziwym skoku celu,
+        // a nie jako nowy skok.
+        if (isReached(&trace) && (destination_ttl == 0 || trace.reached_ttl < destination_ttl))
+            destination_ttl = trace.reached_ttl;
+        int last = destination_ttl > 0 ? destination_ttl : trace.reached_ttl;
+        for (int ttl = 1; ttl <= last; ttl++)
+            for (int i = 0; i < PROBES_PER_TTL; i++) {
+                Probe *probe = &trace.probes[ttl][i];
+                stats[ttl].sent++;
+                if (probe->rtt == -1)
+                    continue;
+                strcpy(stats[ttl].responder, probe->responder);
+                addSample(&stats[ttl], probe->rtt);
+            }
+        if (destination_ttl > 0)
+            hops = destination_ttl;
+        else if (last > hops)
+            hops = last;
+        printStats(target, stats, hops, cycles + 1);
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double left_ms = interval_ms - elapsedMs(&start, &now);
+        if (left_ms > 0 && !stop && (count == 0 || cycles + 1 < count)) {
+            struct timespec pause = {.tv_sec = (time_t)(left_ms / 1000), .tv_nsec = (long)(fmod(left_ms, 1000) * 1000000)};
+            nanosleep(&pause, NULL);
+        }
+    }
+    backend->close(backend->context);
+    return 0;
+}
+
+void usage() {
+    printf("Usage: traceroute [-p | -w window] <IP address>\n"
+           "       traceroute -f <file or -> [-w window] [-c concurrency] [-r probes_per_second, 0 = unlimited] [-C path_cache]\n"
+           "       traceroute -m [-i interval_ms] [-n cycles] <IP address>\n"
+           "Adaptive timeouts in any mode: -t floor_ms:ceiling_ms\n"
+           "Simulated network instead of a raw socket, no root needed: -S topology_file\n"
+           "Don't forget sudo\n");
+}
+
 int main(int argc, char *argv[]) {
+    int window = 0;
+    char *targets = NULL;
+    char *cache_path = NULL;
+    char *topology = NULL;
+    int concurrency = DEFAULT_CONCURRENCY;
+    double rate = DEFAULT_RATE;
+    bool is_monitor = false;
+    int interval_ms = DEFAULT_INTERVAL_MS;
+    long count = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "pw:f:c:r:mi:n:t:C:S:")) != -1) {
+        switch (opt) {
+        case 'S':
+            topology = optarg;
+            break;
+        case 'C':
+            cache_path = optarg;
+            break;
+        case 't':
+            if (sscanf(optarg, "%lf:%lf", &timeout_floor_ms, &timeout_ceiling_ms) != 2 ||
+                timeout_floor_ms <= 0 || timeout_ceiling_ms < timeout_floor_ms) {
+                printf("Invalid timeouts, expected floor_ms:ceiling_ms.\n");
+                return 1;
+            }
+            is_adaptive = true;
+            break;
+        case 'm':
+            is_monitor = true;
+            break;
+        case 'i':
+            interval_ms = atoi(optarg);
+            if (interval_ms < 1) {
+                printf("Invalid interval.\n");
+                return 1;
+            }
+            break;
+        case 'n':
+            count = atol(optarg);
+            if (count < 0) {
+                printf("Invalid number of cycles.\n");
+                return 1;
+            }
+            break;
+        case 'f':
+            targets = optarg;
+            break;
+        case 'c':
+            concurrency = atoi(optarg);
+            if (concurrency < 1 || concurrency > MAX_SLOTS) {
+                printf("Concurrency must be between 1 and %d.\n", MAX_SLOTS);
+                return 1;
+            }
+            break;
+        case 'r':
+            rate = atof(optarg);
+            if (rate < 0) {
+                printf("Invalid probe rate.\n");
+                return 1;
+            }
+            break;
+        case 'p':
+            window = MAX_TTL;
+            break;
+        case 'w':
+            window = atoi(optarg);
+            if (window < 1 || window > MAX_TTL) {
+                printf("Window must be between 1 and %d.\n", MAX_TTL);
+                return 1;
+            }
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    argv += optind - 1;
+    argc -= optind - 1;
+    if (targets != NULL)
+        return traceBatch(targets, window > 0 ? window : MAX_TTL, concurrency, rate, cache_path, topology);
     if (argc != 2) {
-        printf("Wrong number of arguments, expected one IP address.\nDon't forget sudo\n");
+        printf("Wrong number of arguments, expected one IP address.\n");
+        usage();
         return 1;
     }
     if (!isValidIPAddress(argv[1])) {
@@ -163,24 +1675,51 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    // Symulacja działa tylko przez silnik; trasa po jednym TTL odpowiada
+    // trybowi sekwencyjnemu.
+    if (topology != NULL && window == 0)
+        window = 1;
+    if (is_monitor || window > 0) {
+        Backend backend;
+        if (!openBackend(&backend, topology))
+            return 1;
+        if (is_monitor)
+            return monitor(&backend, argv[1], interval_ms, count);
+        Trace trace;
+        initTrace(&trace, argv[1]);
+        Tracer tracer = {.backend = &backend, .traces = &trace, .slots = 1, .active = 1, .window = window};
+        runTracer(&tracer);
+        backend.close(backend.context);
+        return 0;
+    }
+
     // Stworzenie gniazda
     int sockfd = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
     if (sockfd < 0) {
         perror("socket creation failed");
         return 1;
     }
+
+    attachFilter(sockfd);
+    enableTimestamps(sockfd, false);
     int is_reached = false;
+    double earlier_rtt = 0;
+    int last_reply = 0;
     for (int ttl = 1; ttl <= 30 && !is_reached; ttl++) {
         char responseIpAddr[3][INET_ADDRSTRLEN];
         double elapsed_time[3];
         printf("%d. ", ttl);
         bool are_all_on_time = true;
         bool any_response = false;
+        double hop_rtt = 0;
         for (int i = 0; i < 3; i++) {
             int response_type;
             struct timespec start;
             elapsed_time[i] = sendPacket(sockfd, ttl * 3 + i, ttl, argv[1], &start);
-            elapsed_time[i] = receivePacket(sockfd, responseIpAddr[i], &response_type, &start, ttl * 3 + i);
+            elapsed_time[i] = receivePacket(sockfd, responseIpAddr[i], &response_type, &start, ttl * 3 + i,
+                                            probeTimeout(earlier_rtt, ttl - last_reply, hop_rtt));
+            if (elapsed_time[i] > hop_rtt)
+                hop_rtt = elapsed_time[i];
             if (elapsed_time[i] != -1 && response_type == ICMP_ECHOREPLY)
                 is_reached = true;
             bool is_new = true;
@@ -195,6 +1734,10 @@ int main(int argc, char *argv[]) {
             are_all_on_time &= elapsed_time[i] != -1;
             any_response |= elapsed_time[i] != -1;
         }
+        if (hop_rtt > 0) {
+            earlier_rtt = fmax(earlier_rtt, hop_rtt);
+            last_reply = ttl;
+        }
         if (!any_response)
             printf("*\n");
         else {
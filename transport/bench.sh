@@ -0,0 +1,62 @@
+#!/bin/sh
+# Downloads a random file from the local server under several network
+# conditions and reports completion time, goodput, request amplification
+# (GETs received per segment) and client CPU time.
+#
+# Usage: ./bench.sh [size_in_bytes] [transport options...]
+# The sweep can be replaced by listing "name|server options" lines in
+# $SCENARIOS, e.g. SCENARIOS="slow|-d 50 -r 1000000" ./bench.sh
+
+SIZE=${1:-5000000}
+[ $# -gt 0 ] && shift
+PORT=${PORT:-40000}
+SEGMENT=1000
+
+SCENARIOS=${SCENARIOS:-"clean|
+loss 1%|-l 0.01
+loss 10%|-l 0.1
+loss 30%|-l 0.3
+duplicates 5%|-u 0.05
+reorder 10%|-o 0.1 -j 2
+delay 20ms|-d 20 -j 2
+rate 10MB/s|-r 10000000
+mixed|-l 0.05 -d 10 -j 5 -o 0.05 -r 20000000"}
+
+cd "$(dirname "$0")" || exit 1
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+head -c "$SIZE" /dev/urandom > "$WORK/source"
+SEGMENTS=$(( (SIZE + SEGMENT - 1) / SEGMENT ))
+
+printf "%-16s %10s %12s %10s %8s %10s %s\n" scenario time_s goodput_MB/s \
+  requests ampl cpu_s result
+
+echo "$SCENARIOS" | while IFS='|' read -r name options; do
+  [ -z "$name" ] && continue
+  # shellcheck disable=SC2086
+  ./server -p "$PORT" -s 1 $options "$WORK/source" > "$WORK/server.log" &
+  server=$!
+  sleep 0.2
+
+  rm -f "$WORK/output" "$WORK/output.part"
+  start=$(date +%s%N)
+  # The inner shell reports the CPU time of its only child, the client.
+  cpu=$(sh -c '"$@" > /dev/null; times' sh timeout 600 ./transport "$@" \
+          127.0.0.1 "$PORT" "$WORK/output" "$SIZE" |
+        awk 'NR == 2 {
+               split($1, u, /[ms]/); split($2, s, /[ms]/);
+               printf "%.2f", u[1] * 60 + u[2] + s[1] * 60 + s[2] }')
+  end=$(date +%s%N)
+
+  kill -INT "$server"
+  wait "$server"
+  requests=$(awk '{ print $2 }' "$WORK/server.log")
+  if cmp -s "$WORK/source" "$WORK/output"; then result=ok; else result=FAIL; fi
+
+  awk -v name="$name" -v ns=$((end - start)) -v size="$SIZE" \
+      -v requests="$requests" -v segments="$SEGMENTS" -v cpu="$cpu" \
+      -v result="$result" 'BEGIN {
+        t = ns / 1e9
+        printf "%-16s %10.2f %12.2f %10d %8.2f %10s %s\n", name, t,
+               size / t / 1e6, requests, requests / segments, cpu, result }'
+done
@@ -0,0 +1,309 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netinet/ip.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+// Local stand-in for the course server. It answers "GET start length" with
+// "DATA start length" followed by the bytes of the served file, and can make
+// the path between itself and the client lossy, slow and unordered.
+
+#define DEFAULT_PORT 40000
+#define MAX_DATA_SIZE 1000
+#define PACKET_SIZE (MAX_DATA_SIZE + 64)
+#define MAX_PENDING 65536
+#define DEFAULT_QUEUE_MS 100
+
+typedef struct Pending {
+  int64_t send_at_us;
+  struct sockaddr_in client;
+  int64_t offset;
+  int length;
+} Pending;
+
+typedef struct Impairments {
+  double loss;
+  double duplicate;
+  double reorder;
+  int64_t delay_us;
+  int64_t jitter_us;
+  int64_t rate;
+  int64_t queue_us;
+} Impairments;
+
+typedef struct Stats {
+  int64_t requests;
+  int64_t replies;
+  int64_t lost;
+  int64_t duplicated;
+  int64_t reordered;
+  int64_t overflowed;
+  int64_t bytes;
+} Stats;
+
+Pending pending[MAX_PENDING];
+int pending_count = 0;
+Impairments impairments = {.queue_us = DEFAULT_QUEUE_MS * 1000};
+Stats stats;
+int64_t link_free_at_us = 0;
+volatile sig_atomic_t stop = 0;
+
+int64_t now_us() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+double random_unit() { return rand() / ((double)RAND_MAX + 1.0); }
+
+// Pending replies are kept in a binary min-heap ordered by send time.
+void push_pending(Pending reply) {
+  int i = pending_count++;
+  while (i > 0 && pending[(i - 1) / 2].send_at_us > reply.send_at_us) {
+    pending[i] = pending[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  pending[i] = reply;
+}
+
+Pending pop_pending() {
+  Pending top = pending[0];
+  Pending last = pending[--pending_count];
+  int i = 0;
+  while (2 * i + 1 < pending_count) {
+    int child = 2 * i + 1;
+    if (child + 1 < pending_count &&
+        pending[child + 1].send_at_us < pending[child].send_at_us)
+      child++;
+    if (last.send_at_us <= pending[child].send_at_us)
+      break;
+    pending[i] = pending[child];
+    i = child;
+  }
+  pending[i] = last;
+  return top;
+}
+
+// Computes when a reply leaves the emulated link. Propagation delay and
+// jitter are added first, then the reply waits for the link if a rate is
+// set. Replies that would wait longer than the queue allows are dropped, as
+// on a router with a full buffer.
+void schedule_reply(Pending reply, int64_t now) {
+  if (pending_count == MAX_PENDING) {
+    stats.overflowed++;
+    return;
+  }
+
+  int64_t ready = now + impairments.delay_us;
+  if (impairments.jitter_us > 0)
+    ready += (int64_t)(random_unit() * impairments.jitter_us);
+  if (random_unit() < impairments.reorder) {
+    ready += impairments.delay_us + impairments.jitter_us + 1000;
+    stats.reordered++;
+  }
+
+  if (impairments.rate > 0) {
+    int64_t start = link_free_at_us > ready ? link_free_at_us : ready;
+    if (start - ready > impairments.queue_us) {
+      stats.overflowed++;
+      return;
+    }
+    link_free_at_us = start + (reply.length + 28) * 1000000LL / impairments.rate;
+    ready = link_free_at_us;
+  }
+
+  reply.send_at_us = ready;
+  push_pending(reply);
+}
+
+void handle_request(char *message, const struct sockaddr_in *client,
+                    int64_t file_size, int64_t now) {
+  int64_t offset;
+  int length;
+  if (sscanf(message, "GET %" SCNd64 " %d", &offset, &length) != 2)
+    return;
+  stats.requests++;
+  if (offset < 0 || offset >= file_size || length <= 0 ||
+      length > MAX_DATA_SIZE || length > file_size - offset)
+    return;
+
+  if (random_unit() < impairments.loss) {
+    stats.lost++;
+    return;
+  }
+
+  Pending reply = {.client = *client, .offset = offset, .length = length};
+  schedule_reply(reply, now);
+  if (random_unit() < impairments.duplicate) {
+    stats.duplicated++;
+    schedule_reply(reply, now);
+  }
+}
+
+void send_reply(int sockfd, int file_fd, const Pending *reply) {
+  char packet[PACKET_SIZE];
+  int header = snprintf(packet, sizeof(packet), "DATA %" PRId64 " %d\n",
+                        reply->offset, reply->length);
+  if (pread(file_fd, packet + header, reply->length, reply->offset) !=
+      reply->length) {
+    perror("pread failed");
+    return;
+  }
+  if (sendto(sockfd, packet, header + reply->length, 0,
+             (const struct sockaddr *)&reply->client,
+             sizeof(reply->client)) == -1) {
+    if (errno != EAGAIN && errno != ENOBUFS)
+      perror("sendto failed");
+    return;
+  }
+  stats.replies++;
+  stats.bytes += reply->length;
+}
+
+int create_socket(int port) {
+  int sockfd;
+  struct sockaddr_in server_addr;
+
+  if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+    perror("socket creation failed");
+    exit(EXIT_FAILURE);
+  }
+
+  memset(&server_addr, 0, sizeof(server_addr));
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_addr.s_addr = INADDR_ANY;
+  server_addr.sin_port = htons(port);
+
+  if (bind(sockfd, (const struct sockaddr *)&server_addr, sizeof(server_addr)) <
+      0) {
+    perror("bind failed");
+    close(sockfd);
+    exit(EXIT_FAILURE);
+  }
+  return sockfd;
+}
+
+void serve(int sockfd, int file_fd, int64_t file_size) {
+  while (!stop) {
+    int64_t now = now_us();
+    while (pending_count > 0 && pending[0].send_at_us <= now) {
+      Pending reply = pop_pending();
+      send_reply(sockfd, file_fd, &reply);
+    }
+
+    int64_t timeout_us = 100000;
+    if (pending_count > 0 && pending[0].send_at_us - now < timeout_us)
+      timeout_us = pending[0].send_at_us - now;
+
+    fd_set read_fds;
+    FD_ZERO(&read_fds);
+    FD_SET(sockfd, &read_fds);
+    struct timeval timeout = {.tv_sec = timeout_us / 1000000,
+                              .tv_usec = timeout_us % 1000000};
+    if (select(sockfd + 1, &read_fds, NULL, NULL, &timeout) <= 0)
+      continue;
+
+    while (1) {
+      char buffer[64];
+      struct sockaddr_in client;
+      socklen_t client_len = sizeof(client);
+      ssize_t bytes_received =
+          recvfrom(sockfd, buffer, sizeof(buffer) - 1, MSG_DONTWAIT,
+                   (struct sockaddr *)&client, &client_len);
+      if (bytes_received < 0)
+        break;
+      buffer[bytes_received] = '\0';
+      handle_request(buffer, &client, file_size, now_us());
+    }
+  }
+}
+
+void handle_signal(int signal) {
+  (void)signal;
+  stop = 1;
+}
+
+void usage() {
+  printf("Użycie: server [-p port] [-l strata] [-u duplikaty] [-o "
+         "przestawienia] [-d opóźnienie_ms] [-j jitter_ms] "
+         "[-r bajty_na_sekundę] [-q kolejka_ms] [-s ziarno] <plik>\n");
+}
+
+int main(int argc, char *argv[]) {
+  int port = DEFAULT_PORT;
+  unsigned seed = time(NULL);
+  int opt;
+  while ((opt = getopt(argc, argv, "p:l:u:o:d:j:r:q:s:")) != -1) {
+    switch (opt) {
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'l':
+      impairments.loss = atof(optarg);
+      break;
+    case 'u':
+      impairments.duplicate = atof(optarg);
+      break;
+    case 'o':
+      impairments.reorder = atof(optarg);
+      break;
+    case 'd':
+      impairments.delay_us = atof(optarg) * 1000;
+      break;
+    case 'j':
+      impairments.jitter_us = atof(optarg) * 1000;
+      break;
+    case 'r':
+      impairments.rate = strtoll(optarg, NULL, 10);
+      break;
+    case 'q':
+      impairments.queue_us = atof(optarg) * 1000;
+      break;
+    case 's':
+      seed = strtoul(optarg, NULL, 10);
+      break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+  if (optind != argc - 1 || port <= 0 || port >= 65536) {
+    usage();
+    return 1;
+  }
+  srand(seed);
+
+  int file_fd = open(argv[optind], O_RDONLY);
+  struct stat st;
+  if (file_fd == -1 || fstat(file_fd, &st) == -1) {
+    perror("Error opening file");
+    return 1;
+  }
+
+  struct sigaction action = {.sa_handler = handle_signal};
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  int sockfd = create_socket(port);
+  serve(sockfd, file_fd, st.st_size);
+  printf("requests %" PRId64 " replies %" PRId64 " lost %" PRId64
+         " duplicated %" PRId64 " reordered %" PRId64 " overflowed %" PRId64
+         " bytes %" PRId64 "\n",
+         stats.requests, stats.replies, stats.lost, stats.duplicated,
+         stats.reordered, stats.overflowed, stats.bytes);
+  close(sockfd);
+  close(file_fd);
+}
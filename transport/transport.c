@@ -1,212 +1,725 @@
 /* Katarzyna Szmagara 332171 */
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <ifaddrs.h>
 #include <netinet/ip.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
-#define BUF_SIZE 1024
 #define PORT 54322
 #define min(a, b) ((a) < (b) ? (a) : (b))
 #define MAX_DATA_SIZE 1000
-#define WINDOW_SIZE 1000
+#define MAX_WINDOW_SIZE 16384
+#define MIN_WINDOW_SIZE 64
+#define INITIAL_WINDOW_SIZE 256
+#define RATE_SAMPLES 8
+#define MIN_RATE_INTERVAL_US 10000
+#define SKB_TRUESIZE 2304
+#define INITIAL_RTO_US 100000
+#define MIN_RTO_US 10000
+#define MAX_RTO_US 2000000
+#define INITIAL_CWND 16.0
+#define BATCH_SIZE 64
+#define REQUEST_SIZE 48
+#define PACKET_SIZE (MAX_DATA_SIZE + 64)
+#define ARENA_SIZE (2 * BATCH_SIZE)
+#define MAX_THREADS 64
+#define MAX_SOURCES 8
+#define RTT_BUCKETS 24
+#define DEFAULT_REPORT_INTERVAL_MS 1000
+#define JOURNAL_MAGIC 0x4a505254
+#define JOURNAL_VERSION 2
+#define JOURNAL_SYNC_US 500000
+#define JOURNAL_PAGE_WORDS 512
+
+#define BITMAP_WORDS ((MAX_WINDOW_SIZE + 63) / 64)
+
+// Receive window kept as a ring of MAX_WINDOW_SIZE slots. Segment at offset
+// `s` lives in slot (s / MAX_DATA_SIZE) % MAX_WINDOW_SIZE and its bit in
+// `received` tells whether it has already been written to the output file.
+// `sent_at` is the time of the outstanding request for the slot, 0 if there
+// is none, `owner` the source it was requested from, and `retransmitted`
+// marks slots whose replies must not be used as RTT samples.
+typedef struct Window {
+  uint64_t received[BITMAP_WORDS];
+  uint64_t retransmitted[BITMAP_WORDS];
+  int64_t sent_at[MAX_WINDOW_SIZE];
+  uint8_t owner[MAX_WINDOW_SIZE];
+} Window;
+
+// GET requests of one round, formatted in place and sent with one sendmmsg.
+typedef struct RequestBatch {
+  int count;
+  int slots[BATCH_SIZE];
+  char requests[BATCH_SIZE][REQUEST_SIZE];
+  struct iovec iov[BATCH_SIZE];
+  struct mmsghdr msgs[BATCH_SIZE];
+} RequestBatch;
+
+// Fixed arena of segment buffers. Free buffers are kept on a stack of
+// indices, so taking and returning one never touches the heap.
+typedef struct BufferPool {
+  char arena[ARENA_SIZE][PACKET_SIZE];
+  int free_list[ARENA_SIZE];
+  int free_count;
+} BufferPool;
+
+// Buffers leased from the pool for one recvmmsg call.
+typedef struct ReceiveRing {
+  BufferPool *pool;
+  int leased[BATCH_SIZE];
+  int leased_count;
+  struct sockaddr_in senders[BATCH_SIZE];
+  struct iovec iov[BATCH_SIZE];
+  char control[BATCH_SIZE][CMSG_SPACE(sizeof(uint32_t))];
+  struct mmsghdr msgs[BATCH_SIZE];
+} ReceiveRing;
+
+// Counters of one worker. They are added to the shared totals after every
+// batch of replies, so the receive loop never touches shared cache lines.
+// Bucket i of `rtt` counts samples in [2^i, 2^(i+1)) microseconds.
+typedef struct Stats {
+  int64_t requests;
+  int64_t retransmissions;
+  int64_t stolen;
+  int64_t replies;
+  int64_t useful;
+  int64_t bytes;
+  int64_t duplicates;
+  int64_t out_of_window;
+  int64_t ignored;
+  int64_t kernel_drops;
+  int64_t occupancy_samples;
+  int64_t in_flight_sum;
+  int64_t window_sum;
+  int64_t rtt[RTT_BUCKETS];
+} Stats;
+
+// A server with a copy of the file. RTT, congestion window and delivery rate
+// are tracked separately for every source, so a slow mirror only slows down
+// its own share of the requests.
+typedef struct Source {
+  struct sockaddr_in addr;
+  RequestBatch *batch;
+
+  int64_t srtt_us;
+  int64_t rttvar_us;
+  int64_t rto_us;
+  double cwnd;
+  double ssthresh;
+  int in_flight;
+  int64_t last_decrease_us;
+
+  int64_t min_rtt_us;
+  int64_t delivered;
+  int64_t rate_sample_delivered;
+  double rates[RATE_SAMPLES];
+  int rate_index;
+} Source;
+
+// Download of the range [start, end) of the file. With several threads every
+// worker owns one Transfer, including its socket, and only the output file is
+// shared.
+typedef struct Transfer {
+  Source sources[MAX_SOURCES];
+  int source_count;
+  int sockfd;
+  int fd;
+  int64_t start;
+  int64_t end;
+  Window *window;
+  ReceiveRing *ring;
+
+  // Segments requested ahead of `start`, sized from the measured delivery
+  // rates and round trips.
+  int window_size;
+  int receive_buffer;
+  int64_t rate_sample_start_us;
+  uint32_t kernel_drops;
+  Stats stats;
+} Transfer;
+
+// Sidecar file <output>.part with a bitmap of every segment already written
+// to the output. Bits are set in memory as segments arrive and written out
+// in batches, each time after the output itself has been synced, so a bit
+// on disk always refers to data that is on disk too.
+typedef struct JournalHeader {
+  uint32_t magic;
+  uint32_t version;
+  int64_t size;
+  int32_t segment_size;
+  int32_t reserved;
+  // The output the bitmap describes. Its mtime changes with every write, so
+  // only the identity of the file is checked.
+  uint64_t device;
+  uint64_t inode;
+} JournalHeader;
 
-typedef struct Node {
-  char *data;
-  int size;
-  struct Node *next;
-} Node;
+typedef struct Journal {
+  int fd;
+  int data_fd;
+  char path[PATH_MAX];
+  int64_t words;
+  int64_t pages;
+  uint64_t *bitmap;
+  uint64_t *dirty_pages;
+  uint64_t *staging;
+  int64_t *staged_pages;
+  pthread_mutex_t lock;
+  int64_t last_sync_us;
+} Journal;
 
-char *new_message(int start, int length) {
-  char *message = (char *)malloc(30 * sizeof(char));
-  if (message == NULL) {
+Journal journal = {.fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER};
+bool resume = false;
+
+atomic_llong bytes_done = 0;
+int64_t total_size = 0;
+
+Stats totals;
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+int64_t report_interval_us = DEFAULT_REPORT_INTERVAL_MS * 1000LL;
+atomic_llong next_report_us = 0;
+int64_t started_us;
+int64_t last_report_us;
+int64_t last_report_bytes;
+// Peak goodput is sampled over whole windows of the report interval (or of
+// the default one with reports off), whether or not a line is printed.
+double peak_goodput;
+bool has_peak = false;
+int64_t peak_window_started_us;
+int64_t peak_window_bytes;
+Stats reported;
+
+Window *new_window() {
+  Window *window = (Window *)calloc(1, sizeof(Window));
+  if (window == NULL) {
     perror("Allocation failed");
     exit(EXIT_FAILURE);
   }
+  return window;
+}
 
-  sprintf(message, "GET %d %d\n", start, length);
-  return message;
+void free_window(Window *window) { free(window); }
+
+int slot_of(int64_t offset) {
+  return (offset / MAX_DATA_SIZE) % MAX_WINDOW_SIZE;
 }
 
-bool send_request(const char *ip_address, int server_port, const char *message,
-                  int *sockfd) {
-  struct sockaddr_in server_addr;
+int slot_of_segment(int64_t segment) { return segment % MAX_WINDOW_SIZE; }
 
-  memset(&server_addr, 0, sizeof(server_addr));
-  server_addr.sin_family = AF_INET;
-  server_addr.sin_port = htons(server_port);
-  if (inet_pton(AF_INET, ip_address, &server_addr.sin_addr) <= 0) {
-    perror("inet_pton failed");
-    return false;
+bool test_bit(const uint64_t *bitmap, int slot) {
+  return (bitmap[slot / 64] >> (slot % 64)) & 1;
+}
+
+void set_bit(uint64_t *bitmap, int slot, bool value) {
+  if (value)
+    bitmap[slot / 64] |= 1ULL << (slot % 64);
+  else
+    bitmap[slot / 64] &= ~(1ULL << (slot % 64));
+}
+
+bool is_received(const Window *window, int slot) {
+  return test_bit(window->received, slot);
+}
+
+void set_received(Window *window, int slot, bool value) {
+  set_bit(window->received, slot, value);
+}
+
+// Returns the first segment in [segment, end) that has not been received yet,
+// or `end` if there is none. Full bitmap words are skipped at once.
+int64_t next_missing(const Window *window, int64_t segment, int64_t end) {
+  while (segment < end) {
+    int slot = segment % MAX_WINDOW_SIZE;
+    int bit = slot % 64;
+    uint64_t missing = ~window->received[slot / 64] >> bit;
+    int span = min(64 - bit, MAX_WINDOW_SIZE - slot);
+    if (span < 64)
+      missing &= (1ULL << span) - 1;
+    if (missing != 0)
+      return min(segment + __builtin_ctzll(missing), end);
+    segment += span;
   }
+  return end;
+}
 
-  if (sendto(*sockfd, message, strlen(message), 0,
-             (const struct sockaddr *)&server_addr,
-             sizeof(server_addr)) == -1) {
-    perror("sendto failed");
-    return false;
+RequestBatch *new_request_batch(const struct sockaddr_in *server_addr) {
+  RequestBatch *batch = (RequestBatch *)calloc(1, sizeof(RequestBatch));
+  if (batch == NULL) {
+    perror("Allocation failed");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < BATCH_SIZE; i++) {
+    batch->iov[i].iov_base = batch->requests[i];
+    batch->msgs[i].msg_hdr.msg_iov = &batch->iov[i];
+    batch->msgs[i].msg_hdr.msg_iovlen = 1;
+    batch->msgs[i].msg_hdr.msg_name = (void *)server_addr;
+    batch->msgs[i].msg_hdr.msg_namelen = sizeof(*server_addr);
   }
+  return batch;
+}
 
-  return true;
+BufferPool *new_buffer_pool() {
+  BufferPool *pool = (BufferPool *)malloc(sizeof(BufferPool));
+  if (pool == NULL) {
+    perror("Allocation failed");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < ARENA_SIZE; i++)
+    pool->free_list[i] = i;
+  pool->free_count = ARENA_SIZE;
+  return pool;
 }
 
-bool write_to_file(const char *filename, const char *data, int size) {
-  FILE *file = fopen(filename, "ab");
-  if (file == NULL) {
-    perror("Error opening file");
-    return false;
+int acquire_buffer(BufferPool *pool) {
+  if (pool->free_count == 0)
+    return -1;
+  pool->free_count--;
+  return pool->free_list[pool->free_count];
+}
+
+void release_buffer(BufferPool *pool, int buffer) {
+  pool->free_list[pool->free_count] = buffer;
+  pool->free_count++;
+}
+
+ReceiveRing *new_receive_ring(BufferPool *pool) {
+  ReceiveRing *ring = (ReceiveRing *)calloc(1, sizeof(ReceiveRing));
+  if (ring == NULL) {
+    perror("Allocation failed");
+    exit(EXIT_FAILURE);
+  }
+  ring->pool = pool;
+  for (int i = 0; i < BATCH_SIZE; i++) {
+    // One byte is kept for the terminator added in handle_data.
+    ring->iov[i].iov_len = PACKET_SIZE - 1;
+    ring->msgs[i].msg_hdr.msg_iov = &ring->iov[i];
+    ring->msgs[i].msg_hdr.msg_iovlen = 1;
+    ring->msgs[i].msg_hdr.msg_name = &ring->senders[i];
+    ring->msgs[i].msg_hdr.msg_control = ring->control[i];
   }
+  return ring;
+}
 
-  fwrite(data, sizeof(char), size, file);
+// Creates the output file with its final size up front, so every segment can
+// be written straight to its offset no matter in which order it arrives.
+// Opens the output. `existed` tells whether it was there, with the expected
+// size, before this run; only then can a journal describe its contents.
+int open_output(const char *filename, int64_t size, bool *existed) {
+  struct stat before;
+  *existed = resume && stat(filename, &before) == 0 && before.st_size == size;
+  int fd = open(filename, O_RDWR | O_CREAT | (resume ? 0 : O_TRUNC), 0644);
+  if (fd == -1) {
+    perror("Error opening file");
+    exit(EXIT_FAILURE);
+  }
+  if (fallocate(fd, 0, 0, size) == -1 && ftruncate(fd, size) == -1) {
+    perror("Error allocating file");
+    close(fd);
+    exit(EXIT_FAILURE);
+  }
+  return fd;
+}
 
-  fclose(file);
+bool write_segment(int fd, const char *data, int size, int64_t offset) {
+  while (size > 0) {
+    ssize_t written = pwrite(fd, data, size, offset);
+    if (written == -1) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    data += written;
+    size -= written;
+    offset += written;
+  }
   return true;
 }
 
-void print_window(Node *window) {
-  printf("Window contents:\n");
-  int idx = 0;
-  Node *current = window;
-  while (current != NULL) {
-    printf("Node %d: ", idx);
-    if (current->data != NULL) {
-      printf("%s\n", current->data);
-    } else {
-      printf("Empty\n");
+bool journal_has(int64_t segment) {
+  return (__atomic_load_n(&journal.bitmap[segment / 64], __ATOMIC_RELAXED) >>
+          (segment % 64)) &
+         1;
+}
+
+void journal_mark(int64_t segment) {
+  int64_t word = segment / 64;
+  __atomic_fetch_or(&journal.bitmap[word], 1ULL << (segment % 64),
+                    __ATOMIC_RELEASE);
+  int64_t page = word / JOURNAL_PAGE_WORDS;
+  __atomic_fetch_or(&journal.dirty_pages[page / 64], 1ULL << (page % 64),
+                    __ATOMIC_RELEASE);
+}
+
+// Opens the sidecar of `filename`. When resuming, a sidecar written for this
+// very output file, which already existed with the same size, is loaded.
+// Otherwise a fresh one is created. Returns true if previously downloaded
+// segments were loaded.
+bool open_journal(const char *filename, int data_fd, int64_t size,
+                  bool output_existed) {
+  int64_t segments = (size + MAX_DATA_SIZE - 1) / MAX_DATA_SIZE;
+  journal.data_fd = data_fd;
+  journal.words = (segments + 63) / 64;
+  journal.pages = (journal.words + JOURNAL_PAGE_WORDS - 1) / JOURNAL_PAGE_WORDS;
+  journal.bitmap = calloc(journal.words, sizeof(uint64_t));
+  journal.staging = calloc(journal.words, sizeof(uint64_t));
+  journal.dirty_pages = calloc((journal.pages + 63) / 64, sizeof(uint64_t));
+  journal.staged_pages = calloc(journal.pages, sizeof(int64_t));
+  if (journal.bitmap == NULL || journal.staging == NULL ||
+      journal.dirty_pages == NULL || journal.staged_pages == NULL) {
+    perror("Allocation failed");
+    exit(EXIT_FAILURE);
+  }
+  snprintf(journal.path, sizeof(journal.path), "%s.part", filename);
+
+  journal.fd = open(journal.path, O_RDWR | O_CREAT, 0644);
+  if (journal.fd == -1) {
+    perror("Error opening journal");
+    exit(EXIT_FAILURE);
+  }
+
+  struct stat output;
+  if (fstat(data_fd, &output) == -1) {
+    perror("Error reading output");
+    exit(EXIT_FAILURE);
+  }
+  JournalHeader header;
+  size_t bitmap_bytes = journal.words * sizeof(uint64_t);
+  if (resume && output_existed &&
+      pread(journal.fd, &header, sizeof(header), 0) == sizeof(header) &&
+      header.magic == JOURNAL_MAGIC && header.version == JOURNAL_VERSION &&
+      header.size == size && header.segment_size == MAX_DATA_SIZE &&
+      header.device == (uint64_t)output.st_dev &&
+      header.inode == (uint64_t)output.st_ino &&
+      pread(journal.fd, journal.bitmap, bitmap_bytes, sizeof(header)) ==
+          (ssize_t)bitmap_bytes)
+    return true;
+
+  memset(journal.bitmap, 0, bitmap_bytes);
+  header = (JournalHeader){.magic = JOURNAL_MAGIC,
+                           .version = JOURNAL_VERSION,
+                           .size = size,
+                           .segment_size = MAX_DATA_SIZE,
+                           .device = output.st_dev,
+                           .inode = output.st_ino};
+  if (ftruncate(journal.fd, 0) == -1 ||
+      pwrite(journal.fd, &header, sizeof(header), 0) != sizeof(header) ||
+      pwrite(journal.fd, journal.bitmap, bitmap_bytes, sizeof(header)) !=
+          (ssize_t)bitmap_bytes ||
+      fdatasync(journal.fd) == -1) {
+    perror("Error writing journal");
+    exit(EXIT_FAILURE);
+  }
+  return false;
+}
+
+// Persists the bits of every dirty page. The pages are copied first, so
+// bits set while the output is being synced wait for the next batch.
+void journal_sync() {
+  int64_t staged = 0;
+  for (int64_t i = 0; i < (journal.pages + 63) / 64; i++) {
+    uint64_t dirty =
+        __atomic_exchange_n(&journal.dirty_pages[i], 0, __ATOMIC_ACQUIRE);
+    while (dirty != 0) {
+      int64_t page = i * 64 + __builtin_ctzll(dirty);
+      dirty &= dirty - 1;
+      int64_t first = page * JOURNAL_PAGE_WORDS;
+      int64_t words = min(JOURNAL_PAGE_WORDS, journal.words - first);
+      for (int64_t w = 0; w < words; w++)
+        journal.staging[first + w] =
+            __atomic_load_n(&journal.bitmap[first + w], __ATOMIC_ACQUIRE);
+      journal.staged_pages[staged++] = page;
     }
-    current = current->next;
-    idx++;
-  }
-  printf("\n");
-}
-
-int handle_data(char *sender, char *message, const char *ip_address, int start,
-                const char *filename, Node **window) {
-  struct sockaddr_in sa_sender, sa_ip_address;
-  inet_pton(AF_INET, sender, &(sa_sender.sin_addr));
-  inet_pton(AF_INET, ip_address, &(sa_ip_address.sin_addr));
-
-  if (memcmp(&sa_sender.sin_addr, &sa_ip_address.sin_addr,
-             sizeof(struct in_addr)) == 0) {
-    char *data_start = strchr(message, '\n');
-    if (data_start != NULL) {
-      data_start++;
-      int s, l;
-      if (sscanf(message, "DATA %d %d", &s, &l) == 2) {
-        int idx = (s - start) / MAX_DATA_SIZE;
-
-        if (idx >= 0 && idx < WINDOW_SIZE) {
-          if (*window == NULL) {
-            *window = (Node *)malloc(sizeof(Node));
-            (*window)->next = NULL;
-            (*window)->data = NULL;
-            (*window)->size = 0;
-          }
-          Node *temp = *window;
-
-          Node *prev = NULL;
-          for (int i = 0; i <= idx; i++) {
-            if (temp == NULL) {
-              temp = (Node *)malloc(sizeof(Node));
-              temp->next = NULL;
-              temp->data = NULL;
-              temp->size = 0;
-            }
-            if (prev)
-              prev->next = temp;
-            else
-              (*window) = temp;
-            prev = temp;
-            temp = temp->next;
-          }
-
-          if (prev) {
-            prev->data = (char *)malloc(l + 1);
-            memcpy(prev->data, data_start, l);
-            prev->size = l;
-          } else {
-            (*window)->data = (char *)malloc(l + 1);
-            memcpy((*window)->data, data_start, l);
-            (*window)->size = l;
-          }
-        }
+  }
+  if (staged == 0)
+    return;
 
-        if (idx == 0) {
-          int done = 0;
-          int bytes = 0;
-          while (*window && (*window)->size) {
-            Node *temp = *window;
-            if (write_to_file(filename, temp->data, temp->size)) {
-              bytes += temp->size;
-              *window = temp->next;
-              free(temp->data);
-              free(temp);
-              done++;
-            } else {
-              perror("Error writing to file");
-              return false;
-            }
-          }
-
-          return bytes;
-        }
-      }
+  if (fdatasync(journal.data_fd) == -1)
+    perror("Error syncing file");
+  for (int64_t i = 0; i < staged; i++) {
+    int64_t first = journal.staged_pages[i] * JOURNAL_PAGE_WORDS;
+    int64_t words = min(JOURNAL_PAGE_WORDS, journal.words - first);
+    if (pwrite(journal.fd, journal.staging + first, words * sizeof(uint64_t),
+               sizeof(JournalHeader) + first * sizeof(uint64_t)) == -1)
+      perror("Error writing journal");
+  }
+  if (fdatasync(journal.fd) == -1)
+    perror("Error syncing journal");
+}
+
+// Called from the download loops, only one thread syncs at a time.
+void journal_maybe_sync(int64_t now) {
+  if (now - journal.last_sync_us < JOURNAL_SYNC_US ||
+      pthread_mutex_trylock(&journal.lock) != 0)
+    return;
+  if (now - journal.last_sync_us >= JOURNAL_SYNC_US) {
+    journal_sync();
+    journal.last_sync_us = now;
+  }
+  pthread_mutex_unlock(&journal.lock);
+}
+
+// The download is complete, the sidecar is no longer needed.
+void close_journal() {
+  if (fdatasync(journal.data_fd) == -1)
+    perror("Error syncing file");
+  close(journal.fd);
+  unlink(journal.path);
+  free(journal.bitmap);
+  free(journal.staging);
+  free(journal.dirty_pages);
+  free(journal.staged_pages);
+}
+
+int64_t now_us() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+// Smoothed RTT and retransmission timeout as in RFC 6298.
+void update_rtt(Source *t, int64_t sample_us) {
+  if (t->min_rtt_us == 0 || sample_us < t->min_rtt_us)
+    t->min_rtt_us = sample_us;
+  if (t->srtt_us == 0) {
+    t->srtt_us = sample_us;
+    t->rttvar_us = sample_us / 2;
+  } else {
+    int64_t delta = t->srtt_us - sample_us;
+    t->rttvar_us = (3 * t->rttvar_us + (delta < 0 ? -delta : delta)) / 4;
+    t->srtt_us = (7 * t->srtt_us + sample_us) / 8;
+  }
+  t->rto_us = t->srtt_us + 4 * t->rttvar_us;
+  if (t->rto_us < MIN_RTO_US)
+    t->rto_us = MIN_RTO_US;
+  if (t->rto_us > MAX_RTO_US)
+    t->rto_us = MAX_RTO_US;
+}
+
+// Additive increase for every useful reply, with slow start below ssthresh.
+void on_delivery(Source *t, int window_size) {
+  if (t->cwnd < t->ssthresh)
+    t->cwnd += 1.0;
+  else
+    t->cwnd += 1.0 / t->cwnd;
+  if (t->cwnd > window_size)
+    t->cwnd = window_size;
+}
+
+// Multiplicative decrease. Requests sent before the previous decrease belong
+// to a flight that was already penalised, so their loss is not counted again.
+void on_timeout(Source *t, int64_t sent_at, int64_t now) {
+  if (sent_at <= t->last_decrease_us)
+    return;
+  t->ssthresh = t->cwnd / 2 < 2.0 ? 2.0 : t->cwnd / 2;
+  t->cwnd = t->ssthresh;
+  t->last_decrease_us = now;
+}
+
+// Moves the start of the window past every received segment at its head.
+// Returns the number of bytes it moved by.
+int64_t advance(Transfer *t) {
+  Window *window = t->window;
+  int64_t bytes = 0;
+  while (t->start + bytes < t->end &&
+         is_received(window, slot_of(t->start + bytes))) {
+    int first = slot_of(t->start + bytes);
+    set_received(window, first, false);
+    set_bit(window->retransmitted, first, false);
+    bytes += min(MAX_DATA_SIZE, t->end - t->start - bytes);
+  }
+  t->start += bytes;
+  return bytes;
+}
+
+void record_rtt(Stats *stats, int64_t sample_us) {
+  int bucket = 0;
+  while (bucket < RTT_BUCKETS - 1 && sample_us >= 2LL << bucket)
+    bucket++;
+  stats->rtt[bucket]++;
+}
+
+int find_source(const Transfer *t, const struct sockaddr_in *sender) {
+  for (int i = 0; i < t->source_count; i++)
+    if (t->sources[i].addr.sin_addr.s_addr == sender->sin_addr.s_addr &&
+        t->sources[i].addr.sin_port == sender->sin_port)
+      return i;
+  return -1;
+}
+
+int64_t handle_data(Transfer *t, const struct sockaddr_in *sender,
+                    char *message, int length) {
+  int from = find_source(t, sender);
+  if (from == -1) {
+    t->stats.ignored++;
+    return 0;
+  }
+
+  message[length] = '\0';
+  char *data_start = memchr(message, '\n', length);
+  int64_t s;
+  int l;
+  if (data_start == NULL ||
+      sscanf(message, "DATA %" SCNd64 " %d", &s, &l) != 2) {
+    t->stats.ignored++;
+    return 0;
+  }
+  data_start++;
+  if (l > message + length - data_start || s % MAX_DATA_SIZE != 0) {
+    t->stats.ignored++;
+    return 0;
+  }
+  t->stats.replies++;
+
+  int64_t idx = (s - t->start) / MAX_DATA_SIZE;
+  if (s < t->start) {
+    t->stats.duplicates++;
+    return 0;
+  }
+  if (s >= t->end || idx >= MAX_WINDOW_SIZE ||
+      l != min(MAX_DATA_SIZE, t->end - s)) {
+    t->stats.out_of_window++;
+    return 0;
+  }
+
+  Window *window = t->window;
+  int slot = slot_of(s);
+  if (is_received(window, slot)) {
+    t->stats.duplicates++;
+    return 0;
+  }
+  if (!write_segment(t->fd, data_start, l, s)) {
+    perror("Error writing to file");
+    return 0;
+  }
+  journal_mark(s / MAX_DATA_SIZE);
+  set_received(window, slot, true);
+  t->stats.useful++;
+  t->stats.bytes += l;
+  if (window->sent_at[slot] != 0) {
+    Source *owner = &t->sources[window->owner[slot]];
+    if (window->owner[slot] == from &&
+        !test_bit(window->retransmitted, slot)) {
+      int64_t sample = now_us() - window->sent_at[slot];
+      update_rtt(owner, sample);
+      record_rtt(&t->stats, sample);
     }
+    window->sent_at[slot] = 0;
+    owner->in_flight--;
   }
-  return false;
+  t->sources[from].delivered++;
+  on_delivery(&t->sources[from], t->window_size);
+  return advance(t);
 }
 
-bool receive(int sockfd, char *sender, char *buffer) {
+// Marks segments of the window that the journal says were downloaded by an
+// earlier run as received, without requesting them.
+int64_t skip_completed(Transfer *t) {
+  Window *window = t->window;
+  int64_t first = t->start / MAX_DATA_SIZE;
+  int64_t end = min(first + t->window_size,
+                    (t->end + MAX_DATA_SIZE - 1) / MAX_DATA_SIZE);
+  for (int64_t segment = next_missing(window, first, end); segment < end;
+       segment = next_missing(window, segment + 1, end))
+    if (journal_has(segment) && window->sent_at[slot_of_segment(segment)] == 0)
+      set_received(window, slot_of_segment(segment), true);
+  return advance(t);
+}
+
+bool wait_readable(int sockfd, int64_t timeout_us) {
   fd_set read_fds;
   FD_ZERO(&read_fds);
   FD_SET(sockfd, &read_fds);
 
+  if (timeout_us < 0)
+    timeout_us = 0;
   struct timeval timeout;
-  timeout.tv_sec = 0;
-  timeout.tv_usec = 100000;
+  timeout.tv_sec = timeout_us / 1000000;
+  timeout.tv_usec = timeout_us % 1000000;
 
   int select_result = select(sockfd + 1, &read_fds, NULL, NULL, &timeout);
   if (select_result == -1) {
-    perror("select failed");
-    return false;
-  } else if (select_result == 0) {
+    if (errno != EINTR)
+      perror("select failed");
     return false;
   }
+  return select_result > 0 && FD_ISSET(sockfd, &read_fds);
+}
 
-  if (!FD_ISSET(sockfd, &read_fds))
-    return false;
+char *ring_buffer(ReceiveRing *ring, int i) {
+  return ring->pool->arena[ring->leased[i]];
+}
 
-  while (1) {
-    struct sockaddr_in client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    ssize_t bytes_received =
-        recvfrom(sockfd, buffer, BUF_SIZE, MSG_DONTWAIT,
-                 (struct sockaddr *)&client_addr, &client_len);
-    if (bytes_received < 0) {
-      if (errno == EWOULDBLOCK || errno == EAGAIN)
-        break;
-      perror("recvfrom failed");
-      return false;
-    } else if (bytes_received == 0) {
-      printf("Connection closed by peer\n");
-      return false;
-    }
+void release_ring(ReceiveRing *ring) {
+  for (int i = 0; i < ring->leased_count; i++)
+    release_buffer(ring->pool, ring->leased[i]);
+  ring->leased_count = 0;
+}
 
-    strcpy(sender, inet_ntoa(client_addr.sin_addr));
+// Leases up to BATCH_SIZE buffers from the pool and receives datagrams into
+// them. Returns how many were received, 0 if the socket has nothing more to
+// read. The caller hands the buffers back with release_ring.
+int receive(Transfer *t) {
+  ReceiveRing *ring = t->ring;
+  int buffer;
+  while (ring->leased_count < BATCH_SIZE &&
+         (buffer = acquire_buffer(ring->pool)) != -1) {
+    int i = ring->leased_count;
+    ring->leased[i] = buffer;
+    ring->iov[i].iov_base = ring->pool->arena[buffer];
+    ring->leased_count++;
+  }
+  for (int i = 0; i < ring->leased_count; i++) {
+    ring->msgs[i].msg_hdr.msg_namelen = sizeof(ring->senders[i]);
+    ring->msgs[i].msg_hdr.msg_controllen = sizeof(ring->control[i]);
+  }
 
-    return true;
+  int received = recvmmsg(t->sockfd, ring->msgs, ring->leased_count,
+                          MSG_DONTWAIT, NULL);
+  if (received < 0) {
+    if (errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR)
+      perror("recvmmsg failed");
+    release_ring(ring);
+    return 0;
   }
-  return false;
+
+  // SO_RXQ_OVFL carries the number of datagrams the kernel has dropped on
+  // this socket so far. New drops mean replies arrive faster than we read
+  // them, which is treated like a loss.
+  uint32_t drops = t->kernel_drops;
+  for (int i = 0; i < received; i++) {
+    struct msghdr *msg = &ring->msgs[i].msg_hdr;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(msg, cmsg))
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL)
+        memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+  }
+  if (drops != t->kernel_drops) {
+    int64_t now = now_us();
+    t->kernel_drops = drops;
+    for (int i = 0; i < t->source_count; i++)
+      on_timeout(&t->sources[i], now - t->sources[i].srtt_us, now);
+  }
+  return received;
 }
 
-int create_socket() {
+// Binds to `port`, or to an ephemeral port when it is 0.
+int create_socket(int port) {
   int sockfd;
   struct sockaddr_in server_addr;
 
@@ -218,7 +731,7 @@ int create_socket() {
   memset(&server_addr, 0, sizeof(server_addr));
   server_addr.sin_family = AF_INET;
   server_addr.sin_addr.s_addr = INADDR_ANY;
-  server_addr.sin_port = htons(PORT);
+  server_addr.sin_port = htons(port);
 
   if (bind(sockfd, (const struct sockaddr *)&server_addr, sizeof(server_addr)) <
       0) {
@@ -229,52 +742,434 @@ int create_socket() {
   return sockfd;
 }
 
-void transport(const char *ip_address, int server_port, char *filename,
-               int start, int size) {
-  int sockfd = create_socket();
-  Node *first = NULL;
-  Node **window = &first;
-  while (start < size - 1) {
-    Node *temp = *window;
-    for (int i = 0; i < WINDOW_SIZE && i * MAX_DATA_SIZE + start < size; i++) {
-      int new_start = i * MAX_DATA_SIZE + start;
-      int length = min(MAX_DATA_SIZE, size - new_start);
-      int ssss = false;
-      if (temp == NULL) {
-        ssss = true;
-        send_request(ip_address, server_port, new_message(new_start, length),
-                     &sockfd);
-      } else {
-        if (temp->size == 0) {
-          ssss = true;
-          send_request(ip_address, server_port, new_message(new_start, length),
-                       &sockfd);
-        }
-        temp = temp->next;
-      }
-      if (!ssss && start == i)
-        printf("kwa\n");
+// Sends every request queued for a source. Requests the kernel did not
+// accept are no longer considered in flight and will be picked up by the
+// next round.
+void flush_requests(Transfer *t, Source *source) {
+  RequestBatch *batch = source->batch;
+  int sent = 0;
+  while (sent < batch->count) {
+    int result =
+        sendmmsg(t->sockfd, batch->msgs + sent, batch->count - sent, 0);
+    if (result == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS)
+        perror("sendmmsg failed");
+      break;
+    }
+    sent += result;
+  }
+  t->stats.requests += sent;
+  for (int i = sent; i < batch->count; i++) {
+    t->window->sent_at[batch->slots[i]] = 0;
+    source->in_flight--;
+  }
+  batch->count = 0;
+}
+
+void queue_request(Transfer *t, int from, int64_t segment, int64_t now) {
+  Source *source = &t->sources[from];
+  RequestBatch *batch = source->batch;
+  int64_t offset = segment * MAX_DATA_SIZE;
+  int length = min(MAX_DATA_SIZE, t->end - offset);
+  int slot = slot_of_segment(segment);
+  int i = batch->count;
+
+  t->window->sent_at[slot] = now;
+  t->window->owner[slot] = from;
+  source->in_flight++;
+  batch->iov[i].iov_len = snprintf(batch->requests[i], REQUEST_SIZE,
+                                   "GET %" PRId64 " %d\n", offset, length);
+  batch->slots[i] = slot;
+  batch->count++;
+  if (batch->count == BATCH_SIZE)
+    flush_requests(t, source);
+}
+
+// Picks the source with the most room relative to its congestion window,
+// which spreads requests in proportion to what every source delivers.
+// Returns -1 if all of them are full.
+int pick_source(const Transfer *t) {
+  int best = -1;
+  double best_load = 1.0;
+  for (int i = 0; i < t->source_count; i++) {
+    const Source *source = &t->sources[i];
+    double load = source->in_flight / source->cwnd;
+    if (load < best_load) {
+      best = i;
+      best_load = load;
     }
+  }
+  return best;
+}
 
-    char sender[100];
-    char *message = malloc((MAX_DATA_SIZE + 30) * sizeof(char));
-    while (receive(sockfd, sender, message)) {
-      int res =
-          handle_data(sender, message, ip_address, start, filename, window);
-      start += res;
-      if (res) {
-        printf("%lf%% done\n", (double)start / (double)size * 100);
+// A source that still has room once every missing segment is requested takes
+// over requests that have waited at a slower source for longer than its own
+// round trip. The first reply to arrive is used, the other one is ignored.
+void steal_requests(Transfer *t, int64_t first, int64_t end, int64_t now) {
+  Window *window = t->window;
+  int thief;
+  for (int64_t segment = next_missing(window, first, end);
+       segment < end && (thief = pick_source(t)) != -1;
+       segment = next_missing(window, segment + 1, end)) {
+    int slot = slot_of_segment(segment);
+    Source *owner = &t->sources[window->owner[slot]];
+    Source *source = &t->sources[thief];
+    int64_t age = now - window->sent_at[slot];
+    if (window->sent_at[slot] == 0 || window->owner[slot] == thief ||
+        source->srtt_us == 0 || source->srtt_us >= owner->srtt_us ||
+        age < source->srtt_us)
+      continue;
+    owner->in_flight--;
+    set_bit(window->retransmitted, slot, true);
+    queue_request(t, thief, segment, now);
+    t->stats.stolen++;
+  }
+}
+
+// Sends requests for missing segments in the window. A segment is requested
+// again only after the RTO of its source expired, and no source gets more
+// than cwnd requests in flight. Returns the time at which the earliest
+// outstanding request expires.
+int64_t send_requests(Transfer *t) {
+  Window *window = t->window;
+  int64_t now = now_us();
+  int64_t deadline = now + MAX_RTO_US;
+  int64_t first = t->start / MAX_DATA_SIZE;
+  int64_t end = min(first + t->window_size,
+                    (t->end + MAX_DATA_SIZE - 1) / MAX_DATA_SIZE);
+  bool is_full = false;
+  for (int64_t segment = next_missing(window, first, end); segment < end;
+       segment = next_missing(window, segment + 1, end)) {
+    int slot = slot_of_segment(segment);
+    if (window->sent_at[slot] != 0) {
+      Source *owner = &t->sources[window->owner[slot]];
+      if (now - window->sent_at[slot] < owner->rto_us) {
+        deadline = min(deadline, window->sent_at[slot] + owner->rto_us);
+        continue;
       }
-      message = malloc((MAX_DATA_SIZE + 30) * sizeof(char));
+      on_timeout(owner, window->sent_at[slot], now);
+      window->sent_at[slot] = 0;
+      set_bit(window->retransmitted, slot, true);
+      owner->in_flight--;
+      t->stats.retransmissions++;
+    }
+
+    int from = is_full ? -1 : pick_source(t);
+    if (from == -1) {
+      is_full = true;
+      continue;
+    }
+    queue_request(t, from, segment, now);
+    deadline = min(deadline, now + t->sources[from].rto_us);
+  }
+  if (!is_full && t->source_count > 1)
+    steal_requests(t, first, end, now);
+  for (int i = 0; i < t->source_count; i++) {
+    flush_requests(t, &t->sources[i]);
+    t->stats.in_flight_sum += t->sources[i].in_flight;
+  }
+  t->stats.window_sum += t->window_size;
+  t->stats.occupancy_samples++;
+  return deadline;
+}
+
+// Asks for a receive buffer that can hold a whole window of replies. Without
+// CAP_NET_ADMIN the kernel caps SO_RCVBUF at net.core.rmem_max.
+void grow_receive_buffer(Transfer *t) {
+  int wanted = t->window_size * SKB_TRUESIZE;
+  if (wanted <= t->receive_buffer)
+    return;
+  if (setsockopt(t->sockfd, SOL_SOCKET, SO_RCVBUFFORCE, &wanted,
+                 sizeof(wanted)) == -1)
+    setsockopt(t->sockfd, SOL_SOCKET, SO_RCVBUF, &wanted, sizeof(wanted));
+  t->receive_buffer = wanted;
+}
+
+// Samples the delivery rate of every source about once per round trip and
+// resizes the window to twice the sum of their bandwidth-delay products. A
+// lost segment holds the head of the window for a whole RTO, so the delay
+// used is the lowest RTT seen plus the current RTO rather than the RTT alone.
+void update_window(Transfer *t, int64_t now) {
+  int64_t interval = now - t->rate_sample_start_us;
+  int64_t round_trip = 0;
+  for (int i = 0; i < t->source_count; i++)
+    if (t->sources[i].srtt_us > round_trip)
+      round_trip = t->sources[i].srtt_us;
+  if (interval < MIN_RATE_INTERVAL_US || interval < round_trip ||
+      round_trip == 0)
+    return;
+  t->rate_sample_start_us = now;
+
+  double bdp = 0;
+  double cwnd = 0;
+  for (int i = 0; i < t->source_count; i++) {
+    Source *source = &t->sources[i];
+    source->rates[source->rate_index] =
+        (double)(source->delivered - source->rate_sample_delivered) / interval;
+    source->rate_index = (source->rate_index + 1) % RATE_SAMPLES;
+    source->rate_sample_delivered = source->delivered;
+
+    double max_rate = 0;
+    for (int r = 0; r < RATE_SAMPLES; r++)
+      if (source->rates[r] > max_rate)
+        max_rate = source->rates[r];
+    bdp += max_rate * (source->min_rtt_us + source->rto_us);
+    cwnd += source->cwnd;
+  }
+
+  int64_t size = (int64_t)(2 * bdp);
+  if (size < 2 * cwnd)
+    size = 2 * cwnd;
+  if (size < MIN_WINDOW_SIZE)
+    size = MIN_WINDOW_SIZE;
+  if (size > MAX_WINDOW_SIZE)
+    size = MAX_WINDOW_SIZE;
+  t->window_size = size;
+  grow_receive_buffer(t);
+}
+
+void init_transfer(Transfer *t, const struct sockaddr_in *servers,
+                   int server_count, int port, int fd, int64_t start,
+                   int64_t end) {
+  memset(t, 0, sizeof(*t));
+  t->sockfd = create_socket(port);
+  t->fd = fd;
+  t->start = start;
+  t->end = end;
+  t->window = new_window();
+  t->ring = new_receive_ring(new_buffer_pool());
+  t->window_size = INITIAL_WINDOW_SIZE;
+  t->rate_sample_start_us = now_us();
+
+  t->source_count = server_count;
+  for (int i = 0; i < server_count; i++) {
+    Source *source = &t->sources[i];
+    source->addr = servers[i];
+    source->batch = new_request_batch(&source->addr);
+    source->rto_us = INITIAL_RTO_US;
+    source->cwnd = INITIAL_CWND;
+    source->ssthresh = MAX_WINDOW_SIZE;
+  }
+
+  int report_overflow = 1;
+  if (setsockopt(t->sockfd, SOL_SOCKET, SO_RXQ_OVFL, &report_overflow,
+                 sizeof(report_overflow)) == -1)
+    perror("setsockopt SO_RXQ_OVFL failed");
+  grow_receive_buffer(t);
+}
+
+// Adds the counters of a worker to the shared totals and clears them.
+void flush_stats(Stats *stats) {
+  pthread_mutex_lock(&stats_lock);
+  int64_t *total = (int64_t *)&totals;
+  int64_t *local = (int64_t *)stats;
+  for (size_t i = 0; i < sizeof(Stats) / sizeof(int64_t); i++)
+    total[i] += local[i];
+  pthread_mutex_unlock(&stats_lock);
+  memset(stats, 0, sizeof(*stats));
+}
+
+// Prints progress, goodput and the counters of the last interval. Called
+// with stats_lock held.
+void print_report(int64_t now) {
+  int64_t done = atomic_load(&bytes_done);
+  double interval = (now - last_report_us) / 1e6;
+  double goodput =
+      interval > 0 ? (totals.bytes - last_report_bytes) / interval / 1e6 : 0;
+  int64_t samples = totals.occupancy_samples - reported.occupancy_samples;
+  printf("%.1lf%% done, %.2lf MB/s, requests %" PRId64 ", useful %" PRId64
+         ", duplicates %" PRId64 ", out of window %" PRId64
+         ", in flight %.0lf/%.0lf\n",
+         done * 100.0 / total_size, goodput,
+         totals.requests - reported.requests,
+         totals.useful - reported.useful,
+         totals.duplicates - reported.duplicates,
+         totals.out_of_window - reported.out_of_window,
+         samples ? (double)(totals.in_flight_sum - reported.in_flight_sum) /
+                       samples
+                 : 0,
+         samples ? (double)(totals.window_sum - reported.window_sum) / samples
+                 : 0);
+  fflush(stdout);
+  last_report_us = now;
+  last_report_bytes = totals.bytes;
+  reported = totals;
+}
+
+// A short last window is noisy and never counts as the peak.
+void sample_peak(int64_t now) {
+  int64_t window_us = report_interval_us > 0
+                          ? report_interval_us
+                          : DEFAULT_REPORT_INTERVAL_MS * 1000LL;
+  pthread_mutex_lock(&stats_lock);
+  if (now - peak_window_started_us >= window_us) {
+    double goodput = (totals.bytes - peak_window_bytes) /
+                     ((now - peak_window_started_us) / 1e6) / 1e6;
+    if (!has_peak || goodput > peak_goodput)
+      peak_goodput = goodput;
+    has_peak = true;
+    peak_window_started_us = now;
+    peak_window_bytes = totals.bytes;
+  }
+  pthread_mutex_unlock(&stats_lock);
+}
+
+// Flushes the counters of the worker and, if the report interval has passed,
+// lets exactly one worker print the report.
+void maybe_report(Transfer *t, int64_t now) {
+  flush_stats(&t->stats);
+  sample_peak(now);
+  int64_t due = atomic_load(&next_report_us);
+  if (report_interval_us == 0 || now < due ||
+      !atomic_compare_exchange_strong(&next_report_us, &due,
+                                      now + report_interval_us))
+    return;
+  pthread_mutex_lock(&stats_lock);
+  print_report(now);
+  pthread_mutex_unlock(&stats_lock);
+}
+
+int64_t rtt_percentile(double fraction) {
+  int64_t samples = 0;
+  for (int i = 0; i < RTT_BUCKETS; i++)
+    samples += totals.rtt[i];
+  int64_t seen = 0;
+  for (int i = 0; i < RTT_BUCKETS; i++) {
+    seen += totals.rtt[i];
+    if (samples > 0 && seen >= fraction * samples)
+      return 2LL << i;
+  }
+  return 0;
+}
+
+// Final summary on a single JSON line for tools collecting the results. RTT
+// percentiles are upper bounds of their histogram buckets.
+void print_summary(int64_t now) {
+  double seconds = (now - started_us) / 1e6;
+  int64_t samples = totals.occupancy_samples ? totals.occupancy_samples : 1;
+  printf("{\"size\": %" PRId64 ", \"seconds\": %.3lf, "
+         "\"goodput_mbps\": %.3lf, ",
+         total_size, seconds,
+         seconds > 0 ? totals.bytes / seconds / 1e6 : 0);
+  // Without a single full window there is no peak to report.
+  if (has_peak)
+    printf("\"peak_goodput_mbps\": %.3lf, ", peak_goodput);
+  printf("\"requests\": %" PRId64 ", \"retransmissions\": %" PRId64
+         ", \"stolen\": %" PRId64 ", \"replies\": %" PRId64
+         ", \"useful\": %" PRId64 ", \"duplicates\": %" PRId64
+         ", \"out_of_window\": %" PRId64 ", \"ignored\": %" PRId64
+         ", \"kernel_drops\": %" PRId64 ", \"avg_in_flight\": %.1lf, "
+         "\"avg_window\": %.1lf, \"rtt_us\": {\"p50\": %" PRId64
+         ", \"p90\": %" PRId64 ", \"p99\": %" PRId64 ", \"histogram\": [",
+         totals.requests, totals.retransmissions, totals.stolen,
+         totals.replies, totals.useful, totals.duplicates,
+         totals.out_of_window, totals.ignored, totals.kernel_drops,
+         (double)totals.in_flight_sum / samples,
+         (double)totals.window_sum / samples, rtt_percentile(0.5),
+         rtt_percentile(0.9), rtt_percentile(0.99));
+  bool first = true;
+  for (int i = 0; i < RTT_BUCKETS; i++) {
+    if (totals.rtt[i] == 0)
+      continue;
+    printf("%s[%lld, %" PRId64 "]", first ? "" : ", ", 2LL << i,
+           totals.rtt[i]);
+    first = false;
+  }
+  printf("]}}\n");
+}
+
+void *download(void *arg) {
+  Transfer *t = arg;
+  while (t->start < t->end) {
+    if (resume) {
+      int64_t skipped = skip_completed(t);
+      if (skipped)
+        atomic_fetch_add(&bytes_done, skipped);
     }
-    free(message);
+    int64_t deadline = send_requests(t);
+    journal_maybe_sync(now_us());
+    // Reports keep coming while the transfer stalls.
+    int64_t report_due = atomic_load(&next_report_us);
+    if (report_interval_us > 0 && report_due < deadline)
+      deadline = report_due;
+
+    int received;
+    if (wait_readable(t->sockfd, deadline - now_us()))
+      while ((received = receive(t)) > 0) {
+        for (int i = 0; i < received; i++) {
+          int64_t res =
+              handle_data(t, &t->ring->senders[i], ring_buffer(t->ring, i),
+                          t->ring->msgs[i].msg_len);
+          if (res)
+            atomic_fetch_add(&bytes_done, res);
+        }
+        release_ring(t->ring);
+        update_window(t, now_us());
+        if (received < BATCH_SIZE)
+          break;
+      }
+    maybe_report(t, now_us());
   }
-  while (*window) {
-    Node *temp = *window;
-    free((*window)->data);
-    *window = (*window)->next;
-    free(temp);
+  t->stats.kernel_drops += t->kernel_drops;
+  flush_stats(&t->stats);
+  for (int i = 0; i < t->source_count; i++)
+    free(t->sources[i].batch);
+  free(t->ring->pool);
+  free(t->ring);
+  free_window(t->window);
+  close(t->sockfd);
+  return NULL;
+}
+
+void finish(int fd) {
+  int64_t now = now_us();
+  if (report_interval_us > 0)
+    print_report(now);
+  print_summary(now);
+  close_journal();
+  close(fd);
+}
+
+// Splits the file into `threads` ranges of whole segments and downloads each
+// of them on its own thread and socket, from all of the servers. A single
+// thread keeps using PORT.
+void transport(const struct sockaddr_in *servers, int server_count,
+               char *filename, int64_t size, int threads) {
+  bool existed;
+  int fd = open_output(filename, size, &existed);
+  resume = open_journal(filename, fd, size, existed);
+  total_size = size;
+  started_us = last_report_us = peak_window_started_us = now_us();
+  atomic_store(&next_report_us, started_us + report_interval_us);
+  int64_t segments = (size + MAX_DATA_SIZE - 1) / MAX_DATA_SIZE;
+  if (threads > segments)
+    threads = segments;
+  int64_t per_thread = (segments + threads - 1) / threads;
+
+  if (threads == 1) {
+    Transfer t;
+    init_transfer(&t, servers, server_count, PORT, fd, 0, size);
+    download(&t);
+    finish(fd);
+    return;
+  }
+
+  Transfer transfers[MAX_THREADS];
+  pthread_t workers[MAX_THREADS];
+  for (int i = 0; i < threads; i++) {
+    int64_t start = i * per_thread * MAX_DATA_SIZE;
+    int64_t end = min(size, (i + 1) * per_thread * MAX_DATA_SIZE);
+    init_transfer(&transfers[i], servers, server_count, 0, fd, start, end);
+    if (pthread_create(&workers[i], NULL, download, &transfers[i]) != 0) {
+      perror("pthread_create failed");
+      exit(EXIT_FAILURE);
+    }
   }
+  for (int i = 0; i < threads; i++)
+    pthread_join(workers[i], NULL);
+  finish(fd);
 }
 
 bool isValidIPAddress(const char *ipAddress) {
@@ -288,13 +1183,47 @@ bool isValidPort(const char *port) {
 }
 
 bool isValidSize(const char *size) {
-  int num = atoi(size);
-  return num > 0 && num <= 10000000;
+  char *end;
+  errno = 0;
+  long long num = strtoll(size, &end, 10);
+  return errno == 0 && *end == '\0' && num > 0;
+}
+
+bool isValidThreads(const char *threads) {
+  int num = atoi(threads);
+  return num > 0 && num <= MAX_THREADS;
+}
+
+// 0 turns the periodic reports off, leaving only the final summary.
+bool isValidInterval(const char *interval) {
+  char *end;
+  errno = 0;
+  long long num = strtoll(interval, &end, 10);
+  return errno == 0 && *end == '\0' && num >= 0;
+}
+
+// Parses a mirror given as <IP address>:<port>.
+bool parse_mirror(char *mirror, struct sockaddr_in *addr) {
+  char *colon = strrchr(mirror, ':');
+  if (colon == NULL)
+    return false;
+  *colon = '\0';
+  bool is_valid = isValidIPAddress(mirror) && isValidPort(colon + 1);
+  if (is_valid) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(atoi(colon + 1));
+    inet_pton(AF_INET, mirror, &addr->sin_addr);
+  }
+  *colon = ':';
+  return is_valid;
 }
 
 bool validate_argv(int argc, char *argv[]) {
   if (argc != 5) {
-    printf("Użycie: %s <adres_IP> <port> <nazwa_pliku> <rozmiar>\n", argv[0]);
+    printf("Użycie: transport [-r] [-t liczba_wątków] [-m adres_IP:port]... "
+           "[-i odstęp_raportów_ms] <adres_IP> <port> <nazwa_pliku> "
+           "<rozmiar>\n");
     return false;
   }
 
@@ -316,13 +1245,53 @@ bool validate_argv(int argc, char *argv[]) {
 }
 
 int main(int argc, char *argv[]) {
+  int threads = 1;
+  struct sockaddr_in servers[MAX_SOURCES];
+  int server_count = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, "rt:m:i:")) != -1) {
+    switch (opt) {
+    case 'i':
+      if (!isValidInterval(optarg)) {
+        printf("Błędny odstęp raportów.\n");
+        return 1;
+      }
+      report_interval_us = atoll(optarg) * 1000;
+      break;
+    case 'm':
+      if (server_count == MAX_SOURCES) {
+        printf("Za dużo serwerów.\n");
+        return 1;
+      }
+      if (!parse_mirror(optarg, &servers[server_count])) {
+        printf("Błędny adres serwera %s.\n", optarg);
+        return 1;
+      }
+      server_count++;
+      break;
+    case 'r':
+      resume = true;
+      break;
+    case 't':
+      if (!isValidThreads(optarg)) {
+        printf("Błędna liczba wątków.\n");
+        return 1;
+      }
+      threads = atoi(optarg);
+      break;
+    default:
+      return 1;
+    }
+  }
+  argv += optind - 1;
+  argc -= optind - 1;
+
   if (!validate_argv(argc, argv))
     return 1;
-  char ip_address[20];
-  strcpy(ip_address, argv[1]);
-  int server_port = atoi(argv[2]);
-  char filename[20];
-  strcpy(filename, argv[3]);
-  int size = atoi(argv[4]);
-  transport(ip_address, server_port, filename, 0, size);
+  memset(&servers[0], 0, sizeof(servers[0]));
+  servers[0].sin_family = AF_INET;
+  servers[0].sin_port = htons(atoi(argv[2]));
+  inet_pton(AF_INET, argv[1], &servers[0].sin_addr);
+  int64_t size = strtoll(argv[4], NULL, 10);
+  transport(servers, server_count, argv[3], size, threads);
 }
\ No newline at end of file